@@ -2,8 +2,11 @@
 #define AQFS_BASE_H
 
 #include "paras.h"
-#include <bitset>
+#include <algorithm>
 #include <cstring>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
 
 namespace aqfs {
 
@@ -22,34 +25,210 @@ struct blkbuf_t {
     int persist();
 };
 
-/* the in-memory super block controller */
+/*
+ * the in-memory super block controller
+ * the geometry fields describe the volume's layout, as chosen by aqfs.mkfs;
+ * on volumes made before they existed they are 0 on disk, and load() fills
+ * in the fixed layout of paras.h
+ * aqfs.mkfs leaves the inode table as it finds it; inode blocks from
+ * `izeroed` on are zeroed when an inode in them is first loaded
+ */
 struct super_t {
     uint32_t magic;
     uint32_t clean;
+    /* the journal's log, jlen 0 if there is none, see journal_t */
+    uint32_t jstart;
+    uint32_t jlen;
+    uint64_t jseq; /* transactions up to this one are written in place */
+
+    /* geometry */
+    uint32_t blksize;
+    uint32_t nblks;   /* blocks of the volume, each with a bit in dmap */
+    uint32_t ninodes; /* inodes, each with a bit in imap */
+    uint32_t imap_start, dmap_start; /* first blocks of the bitmaps */
+    uint32_t inode_start;            /* first inode block */
+    uint32_t data_start;             /* first block after the inode table */
+    uint32_t izeroed; /* inode blocks initialized, 0 on disk if all are */
 
     int load();
     int persist();
+    /* initialize the inode table up to the block holding `ino` */
+    int izero(uint32_t ino);
+
+    /* the inode block holding `ino` */
+    uint32_t iblk(uint32_t ino) {
+        return this->inode_start + ino / INODES_PER_BLK;
+    }
 };
 
-/* 0 should be reserved */
-template <size_t N> class bitset : public std::bitset<N> {
+/*
+ * a bitmap allocator, 0 should be reserved
+ * `words` is the on-disk image (the layout of std::bitset), the rest is
+ * in-core state: a next-fit cursor, the number of free bits, and which
+ * BLKSIZE pieces of the image changed since they were last written
+ */
+class bitset {
+    size_t N = 0;
+    size_t NWORDS = 0;
+    std::vector<uint64_t> words;
+    std::vector<bool> changed; /* per BLKSIZE bytes of `words` */
+    size_t cursor = 1;         /* where the next search starts */
+    size_t nfree = 0;
+
+    /* free bits of word `w`, with bit 0 and the bits past N masked out */
+    inline uint64_t freebits(size_t w) {
+        uint64_t f = ~this->words[w];
+        if (w == 0)
+            f &= ~(uint64_t)1;
+        if (w == NWORDS - 1 && N % 64 != 0)
+            f &= ((uint64_t)1 << (N % 64)) - 1;
+        return f;
+    }
+
+    /* first free bit in [from, N), N if none */
+    inline size_t next_free(size_t from) {
+        for (size_t w = from / 64; w < NWORDS; w++) {
+            uint64_t f = this->freebits(w);
+            if (w == from / 64)
+                f &= ~(uint64_t)0 << (from % 64);
+            if (f != 0)
+                return w * 64 + __builtin_ctzll(f);
+        }
+        return N;
+    }
+
+    /* first used bit in [from, N), N if none */
+    inline size_t next_used(size_t from) {
+        for (size_t w = from / 64; w < NWORDS; w++) {
+            uint64_t u = ~this->freebits(w);
+            if (w == from / 64)
+                u &= ~(uint64_t)0 << (from % 64);
+            if (u != 0)
+                return std::min(w * 64 + __builtin_ctzll(u), N);
+        }
+        return N;
+    }
+
+    inline void touch(size_t i) {
+        this->changed[i / 8 / BLKSIZE] = true;
+    }
+
   public:
-    inline uint32_t find_empty() {
-        for (size_t i = 1; i < N; i++) {
-            if (this->test(i) == false)
-                return i;
+    bitset() = default;
+    /* `n` bits, all clear */
+    explicit bitset(size_t n)
+        : N(n), NWORDS((n + 63) / 64), words(NWORDS),
+          changed((NWORDS * sizeof(uint64_t) + BLKSIZE - 1) / BLKSIZE, true),
+          nfree(n ? n - 1 : 0) {}
+
+    size_t bits() { return this->N; }
+    /* bytes of the on-disk image */
+    size_t size() { return this->NWORDS * sizeof(uint64_t); }
+    char *data() { return (char *)this->words.data(); }
+
+    inline bool test(size_t i) {
+        return (this->words[i / 64] >> (i % 64)) & 1;
+    }
+    inline void set(size_t i) {
+        if (this->test(i))
+            return;
+        this->words[i / 64] |= (uint64_t)1 << (i % 64);
+        this->touch(i);
+        if (i != 0)
+            this->nfree--;
+        this->cursor = i + 1 < N ? i + 1 : 1;
+    }
+    inline void reset(size_t i) {
+        if (!this->test(i))
+            return;
+        this->words[i / 64] &= ~((uint64_t)1 << (i % 64));
+        this->touch(i);
+        if (i != 0)
+            this->nfree++;
+    }
+    inline size_t count_free() { return this->nfree; }
+
+    /* recompute the in-core state after `words` was loaded */
+    void recount() {
+        this->nfree = 0;
+        for (size_t w = 0; w < NWORDS; w++)
+            this->nfree += __builtin_popcountll(this->freebits(w));
+        this->cursor = 1;
+        std::fill(this->changed.begin(), this->changed.end(), false);
+    }
+
+    /* whether piece `k` (BLKSIZE bytes of the image) changed; clears it */
+    bool take_changed(size_t k) {
+        bool c = this->changed[k];
+        this->changed[k] = false;
+        return c;
+    }
+    size_t pieces() { return this->changed.size(); }
+
+    /* next-fit: the first free bit from the cursor on, wrapping around */
+    inline uint32_t find_empty() { return this->find_empty(this->cursor); }
+    inline uint32_t find_empty(size_t goal) {
+        if (this->nfree == 0)
+            return 0;
+        if (goal == 0 || goal >= N)
+            goal = 1;
+        size_t i = this->next_free(goal);
+        if (i == N)
+            i = this->next_free(1);
+        return i == N ? 0 : i;
+    }
+
+    /*
+     * allocate up to `n` contiguous bits, starting at the first free bit at
+     * or after `goal` (wrapping around); returns the first one, 0 if full,
+     * and the number allocated in `got`
+     */
+    uint32_t alloc(size_t goal = 0, size_t n = 1, size_t *got = nullptr) {
+        uint32_t start = this->find_empty(goal ? goal : this->cursor);
+        size_t len = 0;
+        if (start != 0) {
+            len = std::min(this->next_used(start) - start, n);
+            for (size_t i = start; i < start + len; i++)
+                this->set(i);
         }
-        return 0;
+        if (got)
+            *got = len;
+        return start;
     }
 };
 
-/* the in-memory bitmap blk controller */
+/*
+ * the in-memory bitmap blk controller
+ * on a mounted volume the maps are shared by all threads, and only touched
+ * through the methods below, which take `lock`
+ */
 struct bitmap_t {
-    bitset<N_INODES> imap;
-    bitset<N_DBLKS> dmap;
+    bitset imap; /* one bit per inode */
+    bitset dmap; /* one bit per block, see super_t::nblks */
+    std::mutex lock;
 
+    /* empty maps sized by the superblock, for a new volume */
+    void init();
     int load();    /* 从 bitmap block 读取数据 */
-    int persist(); /* 将数据写回 bitmap block */
+    int persist(); /* 将改动过的部分写回 bitmap block */
+
+    /* a free inode (0 if none), marked used */
+    uint32_t alloc_ino();
+    void free_ino(uint32_t ino);
+    /* see bitset::alloc() */
+    uint32_t alloc_blk(size_t goal = 0, size_t n = 1, size_t *got = nullptr);
+    void free_blk(uint32_t blkno);
+
+    /*
+     * with a journal, freed blocks stay in use in core until the commit that
+     * frees them is durable, so that they are not written over as new data
+     * while a committed link still points at them; persist() writes them out
+     * free, and release() frees those it wrote
+     */
+    bool defer = false;
+    std::vector<uint32_t> freed;
+    size_t npersisted = 0; /* of `freed`, written out by persist() */
+    void release();
 };
 
 } // namespace aqfs
@@ -0,0 +1,132 @@
+#ifndef AQFS_BCACHE_H
+#define AQFS_BCACHE_H
+
+#include "disk.h"
+#include "paras.h"
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <stdint.h>
+#include <time.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace aqfs {
+
+/* default number of cached blocks */
+const size_t BCACHE_NBUFS = 1024;
+/* dirty buffers written back together when one has to be evicted */
+const size_t BCACHE_WB_BATCH = 32;
+/* seconds between two write-backs of all dirty buffers */
+const int BCACHE_FLUSH_INTERVAL = 5;
+
+/* a cached block */
+struct buf_t {
+    uint32_t blkno;
+    uint32_t pin;   /* pinned buffers are never evicted */
+    bool dirty;     /* data differs from the block on disk */
+    bool loading;   /* being read in or written back, without the lock */
+    bool valid;     /* data is the block's content */
+    bool meta;      /* dirty metadata not yet committed, see journal_t */
+    char *data;     /* `mem`, or the block itself on a mapped disk */
+    char mem[BLKSIZE];
+    std::list<buf_t *>::iterator lru; /* valid when not pinned */
+};
+
+/*
+ * the buffer cache, shared by all block I/O
+ * blocks are kept by blkno, unpinned buffers are evicted in LRU order and
+ * dirty ones are written back on eviction, on flush() and periodically
+ * with a journal, uncommitted metadata is never evicted or written back
+ * the cache itself is guarded by `lock`, which is dropped while blocks are
+ * read in or written back, so that misses of different threads overlap
+ * with each other and with write-backs; the content of a pinned buffer is
+ * guarded by whoever owns the block (e.g. the inode lock)
+ */
+class bcache_t {
+    size_t nbufs = BCACHE_NBUFS;
+    std::unordered_map<uint32_t, buf_t *> table;
+    std::list<buf_t *> lru; /* unpinned buffers, least recently used first */
+    time_t flushed = 0;     /* time of the last flush() */
+    bool changed = false;   /* a buffer was dirtied since the checkpoint */
+    size_t nmeta = 0;       /* buffers with `meta` */
+    /* blocks in the journal's log, which data written to has to join */
+    std::unordered_set<uint32_t> logged;
+    std::mutex lock;
+    std::condition_variable loaded; /* some buffer finished loading */
+    static thread_local int batch;  /* begin_batch() nesting */
+
+    void checkpoint();
+    int pin(const uint32_t *blknos, size_t n, buf_t **bufs, bool cached);
+
+    /* the following expect `lock` to be held */
+    int room(std::unique_lock<std::mutex> &l);
+    buf_t *alloc(uint32_t blkno);
+    void unpin(buf_t *b);
+
+  public:
+    /* counters, for sizing the cache */
+    uint64_t hits = 0, misses = 0, evictions = 0, writebacks = 0;
+    uint64_t readaheads = 0;
+    /*
+     * with a journal: the number of uncommitted metadata buffers that
+     * triggers a checkpoint; 0 without, when nothing is held back
+     */
+    size_t commit_at = 0;
+
+    void init(size_t nbufs);
+    /* write back everything and drop all buffers */
+    int fini();
+
+    /*
+     * pin block `blkno`; unless `fill`, the caller is going to overwrite it
+     * as a whole and the content is not read from disk
+     */
+    buf_t *get(uint32_t blkno, bool fill = true);
+    /*
+     * unpin, marking it dirty if the caller changed it; a dirty block is
+     * journaled as metadata unless it holds file `data`
+     */
+    void put(buf_t *b, bool dirty = false, bool data = false);
+
+    /* copy a block out of / into the cache */
+    int read(uint32_t blkno, char *buf);
+    int write(uint32_t blkno, const char *buf, bool data = false);
+    /* batched, misses are read from disk as one batch */
+    int readv(const blkio_t *ios, size_t n);
+    int writev(const blkio_t *ios, size_t n, bool data = false);
+    /*
+     * read ahead: load the blocks that are not cached as one batch, leaving
+     * them unpinned for later reads to find
+     */
+    int prefetch(const uint32_t *blknos, size_t n);
+
+    /*
+     * periodic checkpoints are held back until the outermost end_batch(), so
+     * that the data and metadata changes of one write reach disk together
+     */
+    void begin_batch() { this->batch++; }
+    void end_batch();
+
+    /*
+     * write back all dirty buffers, in blkno order, as one batch without the
+     * lock; metadata waits for its commit
+     */
+    int flush();
+
+    /* for journal_t: pin the uncommitted metadata buffers, in blkno order */
+    void pin_meta(std::vector<buf_t *> &bufs);
+    /* and unpin them, `committed` to the log or not */
+    void unpin_meta(std::vector<buf_t *> &bufs, bool committed);
+    /* the log was checkpointed, nothing is in it any more */
+    void clear_logged();
+    size_t size() {
+        std::lock_guard<std::mutex> l(this->lock);
+        return this->table.size();
+    }
+};
+
+} // namespace aqfs
+
+#endif
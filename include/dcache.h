@@ -0,0 +1,57 @@
+#ifndef AQFS_DCACHE_H
+#define AQFS_DCACHE_H
+
+#include <list>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+
+namespace aqfs {
+
+/* default number of cached directory entries */
+const size_t DCACHE_NENTRIES = 16384;
+
+/* a cached (dir, name) -> ino mapping, ino 0 meaning "no such entry" */
+struct dentry_t {
+    std::string key; /* see dcache_t::key() */
+    uint32_t dir;
+    uint32_t ino;
+};
+
+/*
+ * the dentry cache, in front of dir_t::lookup
+ * it holds both positive and negative entries, and is kept in step with the
+ * directories by dir_t::add and dir_t::remove; entries are evicted in LRU
+ * order; all methods take `lock`
+ */
+class dcache_t {
+    size_t nentries = DCACHE_NENTRIES;
+    std::list<dentry_t> lru; /* most recently used first */
+    std::unordered_map<std::string, std::list<dentry_t>::iterator> table;
+    std::mutex lock;
+
+    static std::string key(uint32_t dir, const char *name);
+
+  public:
+    uint64_t hits = 0, misses = 0;
+
+    void init(size_t nentries);
+    void fini();
+
+    /*
+     * look `name` up in directory `dir`
+     * returns false on a miss, otherwise sets `ino` (0 for a known absence)
+     */
+    bool lookup(uint32_t dir, const char *name, uint32_t &ino);
+    /* remember the result of a lookup, or a change to the directory */
+    void set(uint32_t dir, const char *name, uint32_t ino);
+    /* forget one entry */
+    void drop(uint32_t dir, const char *name);
+    /* forget every entry of directory `dir`, e.g. when it is freed */
+    void purge(uint32_t dir);
+};
+
+} // namespace aqfs
+
+#endif
@@ -1,10 +1,13 @@
 #pragma once
 
 #include "inode.h"
-#include <queue>
+#include <vector>
 
 namespace aqfs {
 
+/* number of directory blocks read in one batch while scanning */
+const size_t DIR_SCAN_BLKS = 8;
+
 struct direntry {
     uint32_t ino;
     char name[60];
@@ -14,16 +17,108 @@ struct dir_blk {
     struct direntry entry[DIRENTRY_PER_BLK];
 };
 
+/*
+ * an entry and its position in the directory, the readdir offset (cookie)
+ * to resume from: the name's hash with its bits reversed, shifted left by
+ * DIR_COOKIE_RANK_BITS, plus the entry's rank among names of the same hash
+ * (in namecmp order). a position does not depend on where the entry is
+ * stored, so it survives converting a directory to the hashed layout and
+ * splitting buckets; reversed, the hash orders buckets by index slot, each
+ * covering one range of positions
+ */
+const int DIR_COOKIE_RANK_BITS = 8;
+
+struct dirslot_t {
+    size_t pos;
+    struct direntry entry;
+};
+
+/*
+ * hashed directories
+ * a directory outgrowing its first block is converted to an extendible hash:
+ * block 0 is the index, the other blocks are buckets (plain dir_blks) or,
+ * once the index outgrows block 0, index pages; a name lives in the bucket
+ * of slot `namehash(name) & ((1 << depth) - 1)`
+ * a slot holds its bucket's dir block and the bucket's local depth; a
+ * bucket without entries has no block (0), so a split that sends every
+ * entry one way allocates nothing
+ * a full bucket is split in two, doubling the index when needed; the slots
+ * live in block 0 up to DIR_INDEX_INLINE_DEPTH, and then in index pages
+ * listed in block 0, up to DIR_INDEX_MAX_DEPTH (16M entries and more)
+ * directories hashed before there were index pages (DIR_INDEX_MAGIC_V1,
+ * 16-bit slots in block 0) are looked up as they are, and rebuilt on their
+ * first change
+ */
+const uint32_t DIR_INDEX_MAGIC = 0xffffd1a1;
+const uint32_t DIR_INDEX_MAGIC_V1 = 0xffffd1a0;
+const int DIR_INDEX_INLINE_DEPTH = 9;
+const int DIR_INDEX_MAX_DEPTH = 18;
+const uint32_t DIR_INDEX_PAGE_SLOTS = BLKSIZE / sizeof(uint32_t);
+const uint32_t DIR_INDEX_MAX_PAGES =
+    (1u << DIR_INDEX_MAX_DEPTH) / DIR_INDEX_PAGE_SLOTS;
+/* buckets are named by 24 bits of dir block */
+const uint32_t DIR_MAX_BLKS = 1u << 24;
+
+inline uint32_t dir_slot(uint32_t blk, uint32_t depth) {
+    return depth << 24 | blk;
+}
+inline uint32_t dir_slot_blk(uint32_t slot) { return slot & 0xffffff; }
+inline uint32_t dir_slot_depth(uint32_t slot) { return slot >> 24; }
+
+struct dir_index {
+    uint32_t magic; /* where a linear directory has its first entry's ino */
+    uint32_t depth; /* the index uses 1 << depth slots */
+    uint32_t npages; /* index pages, 0 while the slots are in `slot` */
+    uint32_t pad;
+    uint32_t slot[1 << DIR_INDEX_INLINE_DEPTH];
+    uint32_t page[DIR_INDEX_MAX_PAGES]; /* dir block of each index page */
+};
+static_assert(sizeof(struct dir_index) <= BLKSIZE, "dir_index too large");
+
+struct dir_index_v1 {
+    uint32_t magic;
+    uint32_t depth;
+    char pad[sizeof(struct direntry) - 8];
+    uint16_t bucket[1 << 10]; /* dir block of each slot */
+};
+
 struct dir_t : public inode_t {
 
   public:
     dir_t(uint32_t ino) : inode_t(ino) {}
 
     uint32_t lookup(const char *name);
-    std::queue<struct direntry> read();
+    /*
+     * append the entries at positions `pos` on in position order to `out`,
+     * reading up to DIR_SCAN_BLKS buckets (all of a linear directory), and
+     * move `pos` past them
+     * returns 1 if there may be more, 0 at the end, -1 on error
+     */
+    int read(size_t &pos, std::vector<dirslot_t> &out);
     int add(uint32_t ino, const char *name);
     int remove(const char *name);
     bool hasChild();
+
+  private:
+    /* read block 0 into `idx`, true if the directory is hashed */
+    bool hashed(blkbuf_t &idx);
+    /* is block `n` of a hashed directory the index or an index page */
+    static bool isindex(blkbuf_t &idx, size_t n);
+    uint32_t hlookup(blkbuf_t &idx, const char *name);
+    int hread(blkbuf_t &idx, size_t &pos, std::vector<dirslot_t> &out);
+    int hadd(blkbuf_t &idx, uint32_t ino, const char *name);
+    int hremove(blkbuf_t &idx, const char *name);
+    /* split the bucket of index slot `slot` */
+    int split(blkbuf_t &idx, uint32_t slot);
+    int slot_get(blkbuf_t &idx, uint32_t s, uint32_t &v);
+    /* set the slots `first`, `first + step`, ... to `v` */
+    int slot_set(blkbuf_t &idx, uint32_t first, uint32_t step, uint32_t v);
+    /* double the index */
+    int grow(blkbuf_t &idx);
+    /* a zeroed block `n` appended to the directory */
+    int newblk(blkbuf_t &buf, uint32_t &n);
+    /* turn a full linear directory into a hashed one */
+    int convert();
 };
 
 } // namespace aqfs
@@ -1,16 +1,66 @@
 #pragma once
 
+#include "uring.h"
+#include <mutex>
+#include <stdint.h>
 #include <string>
 
 namespace aqfs {
 
+/* one block of a batched request */
+struct blkio_t {
+    uint32_t blkno;
+    char *buf;
+};
+
+/* io_uring queue depth used for batched block I/O */
+const int DISK_URING_DEPTH = 64;
+
+/*
+ * the virtual block device, either
+ *  - a directory holding one `blk_%04d` file per block (a missing one
+ *    reads as zeros), or
+ *  - a single image file (or raw block device), accessed with pread/pwrite
+ *    on one fd kept open for the whole mount, or
+ *  - the same image mmap()ed as a whole, so block I/O is a memcpy and
+ *    changes are made durable by msync()
+ * batches go through io_uring on an unmapped image when the kernel has it,
+ * and one block at a time otherwise
+ */
 class disk_t {
     std::string root;
+    int fd = -1;         /* image fd, -1 when using the per-block files */
+    char *map = nullptr; /* the mapped image, if mapped */
+    size_t mapsize = 0;
+    uring_t ring; /* batched I/O on the image, if available */
+    std::mutex ringlock; /* the ring is used by one batch at a time */
+
+    int rw(bool write, const blkio_t *ios, size_t n);
 
   public:
-    void setroot(std::string root) { this->root = root; }
+    /* pick the layout from the type of `root` and open it */
+    int open(std::string root, bool mmap = false);
+    void close();
+    bool isimage() { return this->fd >= 0; }
+
+    /* address of block `blkno` in the mapping, nullptr if not mapped */
+    char *blkaddr(uint32_t blkno);
+
     int read(uint32_t blkno, char *buf);
     int write(uint32_t blkno, char *buf);
+    /*
+     * submit `n` block reads (writes) as one batch and wait for all of
+     * them; consecutive blocks are merged into one request
+     */
+    int readv(const blkio_t *ios, size_t n) { return this->rw(false, ios, n); }
+    int writev(const blkio_t *ios, size_t n) { return this->rw(true, ios, n); }
+    /*
+     * tell the backend that the blocks will be read soon, so it can start
+     * fetching them in the background; only a hint, nothing to fail
+     */
+    void advise(const uint32_t *blknos, size_t n);
+    /* make all written blocks durable */
+    int sync();
 };
 
 } // namespace aqfs
@@ -0,0 +1,22 @@
+#ifndef AQFS_FILE_H
+#define AQFS_FILE_H
+
+#include "inode.h"
+
+namespace aqfs {
+
+/*
+ * an open file or directory, what fi->fh points to
+ * it holds the in-core inode, which stays valid after an unlink until the
+ * last close, and the file's read state (readahead, mapped blocks)
+ */
+struct file_t {
+    inode_t inode;
+    fstate_t state;
+
+    file_t(uint32_t ino) : inode(ino) {}
+};
+
+} // namespace aqfs
+
+#endif
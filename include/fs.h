@@ -4,6 +4,8 @@
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
 
+#include "stats.h"
+
 namespace aqfs {
 
 struct fs {
@@ -32,6 +34,8 @@ struct fs {
                     struct fuse_file_info *fi);
     static int write(const char *path, const char *buf, size_t size,
                      off_t offset, struct fuse_file_info *fi);
+    static int fsync(const char *path, int datasync,
+                     struct fuse_file_info *fi);
     static int release(const char *path, struct fuse_file_info *fi);
     static int releasedir(const char *path, struct fuse_file_info *fi);
     static int utimens(const char *path, const struct timespec tv[2]);
@@ -39,25 +43,26 @@ struct fs {
     fs() {
         op.init = init;
         op.destroy = destroy;
-        op.getattr = getattr;
-        op.readlink = readlink;
-        // op.opendir = opendir;
-        op.readdir = readdir;
-        op.mkdir = mkdir;
-        op.unlink = unlink;
-        op.rmdir = rmdir;
-        op.symlink = symlink;
-        op.rename = rename;
-        op.link = link;
-        op.chmod = chmod;
-        op.truncate = truncate;
-        // op.open = open;
-        op.create = create;
-        op.read = read;
-        op.write = write;
-        // op.release = release;
-        // op.releasedir = releasedir;
-        op.utimens = utimens;
+        op.getattr = STAT_OP(GETATTR, getattr);
+        op.readlink = STAT_OP(READLINK, readlink);
+        op.opendir = STAT_OP(OPENDIR, opendir);
+        op.readdir = STAT_OP(READDIR, readdir);
+        op.mkdir = STAT_OP(MKDIR, mkdir);
+        op.unlink = STAT_OP(UNLINK, unlink);
+        op.rmdir = STAT_OP(RMDIR, rmdir);
+        op.symlink = STAT_OP(SYMLINK, symlink);
+        op.rename = STAT_OP(RENAME, rename);
+        op.link = STAT_OP(LINK, link);
+        op.chmod = STAT_OP(CHMOD, chmod);
+        op.truncate = STAT_OP(TRUNCATE, truncate);
+        op.open = STAT_OP(OPEN, open);
+        op.create = STAT_OP(CREATE, create);
+        op.read = STAT_OP(READ, read);
+        op.write = STAT_OP(WRITE, write);
+        op.fsync = STAT_OP(FSYNC, fsync);
+        op.release = STAT_OP(RELEASE, release);
+        op.releasedir = STAT_OP(RELEASEDIR, releasedir);
+        op.utimens = STAT_OP(UTIMENS, utimens);
     }
 };
 
@@ -0,0 +1,80 @@
+#ifndef AQFS_FS_LL_H
+#define AQFS_FS_LL_H
+
+#define FUSE_USE_VERSION 26
+#include <fuse_lowlevel.h>
+
+namespace aqfs {
+
+/*
+ * the FUSE low-level frontend: requests name inodes by number, so nothing
+ * is looked up by path; an inode the kernel has looked up stays in core
+ * until the kernel forgets it
+ */
+struct fs_ll {
+
+    struct fuse_lowlevel_ops op;
+
+    static void init(void *userdata, struct fuse_conn_info *conn);
+    static void destroy(void *userdata);
+
+    static void lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+    static void forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup);
+    static void getattr(fuse_req_t req, fuse_ino_t ino,
+                        struct fuse_file_info *fi);
+    static void setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                        int to_set, struct fuse_file_info *fi);
+    static void readlink(fuse_req_t req, fuse_ino_t ino);
+    static void mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      mode_t mode);
+    static void unlink(fuse_req_t req, fuse_ino_t parent, const char *name);
+    static void rmdir(fuse_req_t req, fuse_ino_t parent, const char *name);
+    static void symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                        const char *name);
+    static void rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                       fuse_ino_t newparent, const char *newname);
+    static void link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                     const char *newname);
+    static void open(fuse_req_t req, fuse_ino_t ino,
+                     struct fuse_file_info *fi);
+    static void release(fuse_req_t req, fuse_ino_t ino,
+                        struct fuse_file_info *fi);
+    static void read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                     struct fuse_file_info *fi);
+    static void write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                      size_t size, off_t off, struct fuse_file_info *fi);
+    static void fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                      struct fuse_file_info *fi);
+    static void readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                        off_t off, struct fuse_file_info *fi);
+    static void create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                       mode_t mode, struct fuse_file_info *fi);
+
+    fs_ll() {
+        op = {};
+        op.init = init;
+        op.destroy = destroy;
+        op.lookup = lookup;
+        op.forget = forget;
+        op.getattr = getattr;
+        op.setattr = setattr;
+        op.readlink = readlink;
+        op.mkdir = mkdir;
+        op.unlink = unlink;
+        op.rmdir = rmdir;
+        op.symlink = symlink;
+        op.rename = rename;
+        op.link = link;
+        op.open = open;
+        op.release = release;
+        op.read = read;
+        op.write = write;
+        op.fsync = fsync;
+        op.readdir = readdir;
+        op.create = create;
+    }
+};
+
+} // namespace aqfs
+
+#endif
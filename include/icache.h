@@ -0,0 +1,63 @@
+#ifndef AQFS_ICACHE_H
+#define AQFS_ICACHE_H
+
+#include "inode.h"
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <stdint.h>
+#include <unordered_map>
+
+namespace aqfs {
+
+/* default number of in-core inodes kept while nobody refers to them */
+const size_t ICACHE_NINODES = 4096;
+/* unreferenced inodes looked at for eviction per put() */
+const size_t ICACHE_EVICT_SCAN = 32;
+
+/*
+ * the inode cache, holding the in-core inodes behind every inode_t
+ * an in-core inode lives as long as it is referred to, and is then kept in
+ * LRU order until evicted; dirty inodes are written back to their inode
+ * blocks by flush(), where inodes sharing a block are written together, and
+ * only evicted after that
+ * the table is guarded by `lock`, which is dropped while an inode is read
+ * in; flush() reads each inode under its lock, so it runs when no operation
+ * is halfway (see journal_t::commit)
+ */
+class icache_t {
+    size_t ninodes = ICACHE_NINODES;
+    std::unordered_map<uint32_t, icnode_t *> table;
+    std::list<icnode_t *> lru; /* unreferenced inodes, oldest first */
+    std::mutex lock;
+    std::condition_variable loaded; /* some inode finished loading */
+
+  public:
+    uint64_t hits = 0, misses = 0;
+
+    void init(size_t ninodes);
+    /* write back everything and drop all in-core inodes */
+    int fini();
+
+    /*
+     * take a reference to inode `ino`, reading it in if needed; nullptr if
+     * it can not be read, which leaves nothing in the table
+     */
+    icnode_t *get(uint32_t ino);
+    void put(icnode_t *ic);
+
+    /*
+     * the modes of inodes `inos`, for listing a directory: from the in-core
+     * inode if there is one, else straight from the inode block, without
+     * bringing the inode in core; each inode block is looked up once
+     * to be called with no inode locked
+     */
+    void modes(size_t n, const uint32_t *inos, mode_t *modes);
+
+    /* write back all dirty inodes, one inode block at a time */
+    int flush();
+};
+
+} // namespace aqfs
+
+#endif
@@ -2,26 +2,113 @@
 #define AQFS_INODE_H
 
 #include "base.h"
+#include <cstddef>
 #include <iostream>
+#include <list>
+#include <mutex>
+#include <shared_mutex>
 #include <stdint.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <unordered_map>
+#include <vector>
 
 namespace aqfs {
 
-/* the on disk inode structure */
+struct buf_t;
+
+/*
+ * extent mapping, the alternative to direct + indirect links
+ * an extent maps `len` logical blocks from `lblk` on to the physical blocks
+ * from `pblk` on; extents are kept sorted by lblk, either inline in the
+ * inode (depth 0), or in leaf blocks under `depth` levels of index nodes,
+ * the first of which is in the inode; an index entry holds the first lblk
+ * of the node below it and that node's blkno, with len 0
+ */
+const uint32_t EXTENT_MAGIC = 0xffffe0e0; /* never a valid block number */
+
+struct extent_t {
+    uint32_t lblk;
+    uint32_t pblk;
+    uint32_t len;
+};
+
+struct extent_hdr {
+    uint32_t magic;
+    uint16_t nent;  /* extents (or index entries) in use */
+    uint16_t depth; /* 0 in leaf blocks */
+};
+
+const int EXTENTS_IN_INODE = 3;
+const int EXTENTS_PER_BLK =
+    (BLKSIZE - sizeof(struct extent_hdr)) / sizeof(struct extent_t);
+
+/*
+ * index levels an extent tree may have; at depth 4 a tree already holds
+ * more extents than a file has blocks
+ */
+const int EXT_MAX_DEPTH = 5;
+
+/* the mapping area of an extent mapped inode */
+struct extent_root {
+    struct extent_hdr hdr;
+    struct extent_t ent[EXTENTS_IN_INODE];
+};
+
+/* extent leaf or index block */
+struct extent_blk {
+    struct extent_hdr hdr;
+    struct extent_t ent[EXTENTS_PER_BLK];
+};
+
+/*
+ * the on disk inode structure
+ * the double and triple indirect links and size_hi take the place of the
+ * last three single indirect links of old, which a file could only reach
+ * on a volume larger than the fixed layout's
+ */
 struct inode {
     /* metadata */
     mode_t mode;       /* file mode, see man 2 stat */
     uint32_t refcount; /* how many dirs link to this inode */
-    uint32_t size;     /* file size */
+    uint32_t size;     /* file size, the low 32 bits */
     /* direct links, each point to a data block */
     uint32_t direct[DIRECT_BLKS_PER_INODE];
     /* single indirect block, each point to an indirect data block */
     uint32_t single_indrect[SINGLE_INDRECT_BLKS_PER_INODE];
+    /* a block of single indirect links, and a block of double ones */
+    uint32_t double_indrect;
+    uint32_t triple_indrect;
+    uint32_t size_hi;
 
+    int load_from_ino(uint32_t ino);
     int save_to_ino(uint32_t ino);
+
+    uint64_t getsize() { return this->size | (uint64_t)this->size_hi << 32; }
+    void setsize(uint64_t size) {
+        this->size = (uint32_t)size;
+        this->size_hi = size >> 32;
+    }
+
+    /* extent mapped inodes reuse the link area, see extent_root */
+    struct extent_root *extents() {
+        return (struct extent_root *)this->direct;
+    }
+    bool isextents() { return this->extents()->hdr.magic == EXTENT_MAGIC; }
 };
+static_assert(sizeof(struct inode) * INODES_PER_BLK == BLKSIZE,
+              "inodes do not fill their block");
+static_assert(sizeof(struct extent_root) <=
+                  offsetof(struct inode, size_hi) - offsetof(struct inode, direct),
+              "extent_root does not fit in the inode");
+
+/* logical blocks the links of an inode reach, the limit for extents too */
+const uint64_t MAX_FILE_BLKS =
+    DIRECT_BLKS_PER_INODE +
+    (uint64_t)SINGLE_INDRECT_BLKS_PER_INODE * INDRECT_LINK_PER_BLK +
+    (uint64_t)INDRECT_LINK_PER_BLK * INDRECT_LINK_PER_BLK +
+    (uint64_t)INDRECT_LINK_PER_BLK * INDRECT_LINK_PER_BLK * INDRECT_LINK_PER_BLK;
+const uint64_t MAX_FILE_SIZE = MAX_FILE_BLKS * BLKSIZE;
 
 /* inode block, only contain inodes */
 struct inode_blk {
@@ -33,83 +120,212 @@ struct indirect_blk {
     uint32_t link[INDRECT_LINK_PER_BLK];
 };
 
-/* the in memory inode_t */
+/* sequential readahead window, in blocks */
+const uint32_t RA_MIN_BLKS = 4;
+const uint32_t RA_MAX_BLKS = 64;
+
+/*
+ * what the reads of a file carry from one call to the next, per open file
+ * (or per in-core inode for reads without one); readers change it
+ * concurrently, so it has a lock of its own
+ */
+struct fstate_t {
+    std::mutex lock;
+    /* readahead, see inode_t::readahead() */
+    uint32_t ra_next = 0; /* the block a sequential read would start at */
+    uint32_t ra_size = 0; /* current window, 0 while reads are not sequential */
+    uint32_t ra_end = 0;  /* blocks before this have been read ahead */
+    /* blocks [mapfirst, mapfirst + map.size()) as mapped at `mapgen` */
+    uint32_t mapgen = 0;
+    size_t mapfirst = 0;
+    std::vector<uint32_t> map;
+};
+
+/* interior mapping blocks an in-core inode keeps pinned */
+const size_t MAP_CACHE_BLKS = 64;
+
+/*
+ * the in-core inode, shared by all inode_t of the same ino (see icache_t)
+ * `lock` guards the rest, except `fstate` and the map cache
+ */
+struct icnode_t {
+    uint32_t ino;
+    uint32_t nref;    /* inode_t objects referring to it */
+    uint32_t nopen;   /* open files, see inode_t::open() */
+    bool dirty;       /* changed since written to its inode block */
+    uint32_t dirhint; /* directories: first block that may have a free slot */
+    uint32_t mapgen;  /* bumped whenever blocks are mapped or unmapped */
+    bool loading;     /* being read in, without the icache lock */
+    bool valid;       /* read in; false for a stand-in, see inode_t::bad() */
+    fstate_t fstate;  /* for reads without an open file */
+    struct inode inode;
+    std::shared_mutex lock;
+    std::list<icnode_t *>::iterator lru; /* valid when nref is 0 */
+    /*
+     * the map cache: interior blocks of the block map (those linking further
+     * mapping blocks) by blkno, up to MAP_CACHE_BLKS of them pinned in the
+     * buffer cache for as long as the inode is in core, so that only the
+     * last mapping block of a walk can miss; readers add to it concurrently,
+     * under `maplock`
+     */
+    std::mutex maplock;
+    std::unordered_map<uint32_t, buf_t *> mapbufs;
+};
+
+/* the in memory inode_t, a counted reference to the in-core inode */
 class inode_t {
   protected:
     uint32_t ino; /* unique inode number */
-    struct inode inode;
-    bool dirty;
+    icnode_t *ic;
 
   public:
     inode_t() = delete;
-    inode_t(uint32_t ino) {
-        this->setino(ino);
-        this->fill();
-        this->dirty = false;
-    }
-    ~inode_t() {
-        if (this->dirty)
-            this->persist();
-    }
+    inode_t(uint32_t ino);
+    inode_t(const inode_t &other);
+    inode_t &operator=(const inode_t &other);
+    ~inode_t();
 
-    void setino(uint32_t ino) { this->ino = ino; } /* !! set inode number !! */
+    /*
+     * the inode could not be read in; it is then a zeroed stand-in of this
+     * inode_t's own, never written back, and callers give EIO
+     */
+    bool bad() { return !this->ic->valid; }
 
-    void zero() {
-        this->inode = {};
-        this->dirty = true;
+    /* reset the inode, mapping its data with extents if `extents` */
+    void zero(bool extents = false) {
+        this->ic->inode = {};
+        if (extents)
+            this->ic->inode.extents()->hdr.magic = EXTENT_MAGIC;
+        this->ic->dirty = true;
     }
 
+    /*
+     * the inode's reader/writer lock, so that std::unique_lock and
+     * std::shared_lock work on inode_t; see fs.cpp for the lock order
+     */
+    void lock() { this->ic->lock.lock(); }
+    void unlock() { this->ic->lock.unlock(); }
+    void lock_shared() { this->ic->lock.lock_shared(); }
+    void unlock_shared() { this->ic->lock.unlock_shared(); }
+
     /* set & get inode contents */
     uint32_t getino() { return this->ino; };
-    mode_t getmode() { return this->inode.mode; }
-    uint32_t getsize() { return this->inode.size; }
-    uint32_t getrefcount() { return this->inode.refcount; }
+    mode_t getmode() { return this->ic->inode.mode; }
+    uint64_t getsize() { return this->ic->inode.getsize(); }
+    uint32_t getrefcount() { return this->ic->inode.refcount; }
 
     void setmode(mode_t mode) {
-        this->inode.mode = mode;
-        this->dirty = true;
+        this->ic->inode.mode = mode;
+        this->ic->dirty = true;
     }
 
     void addref() {
-        this->inode.refcount++;
-        this->dirty = true;
+        this->ic->inode.refcount++;
+        this->ic->dirty = true;
     }
 
     void deref() {
-        this->inode.refcount--;
-        this->dirty = true;
-        if (this->inode.refcount == 0) {
+        this->ic->inode.refcount--;
+        this->ic->dirty = true;
+        if (this->ic->inode.refcount == 0 && this->ic->nopen == 0) {
             this->destory();
         }
     }
 
-    /* read nbytes from associated data, starting from offset */
-    int read(size_t nbyte, size_t offset, char *buf);
+    /* an open inode outlives its last link until the last close() */
+    void open() { this->ic->nopen++; }
+    void close() {
+        if (--this->ic->nopen == 0 && this->ic->inode.refcount == 0)
+            this->destory();
+    }
+
+    /*
+     * read nbytes from associated data, starting from offset, with the
+     * readahead and block map state of `fs` (by default the inode's own)
+     */
+    int read(size_t nbyte, size_t offset, char *buf, fstate_t *fs = nullptr);
     int write(size_t nbyte, size_t offset, const char *buf);
+    /* change the size, a file grows by a hole */
     int extendto(size_t nbyte);
     int shrinkto(size_t nbyte);
-
-    /**
-     * If the inode structure is in memory, we may need to write changes
-     * back to the on-disk inode (locate using self->ino).
+    /*
+     * an empty inode of the same kind (links or extents), outside the inode
+     * cache and never written back: somewhere to park a block map while a
+     * new one is built, see swap_map()
      */
-    int persist() {
-        this->dirty = false;
-
-        int res = this->inode.save_to_ino(this->ino);
-        if (res != 0)
-            this->dirty = true;
-        return res;
-    }
+    inode_t scratch();
+    /* trade block maps, and with them sizes, with `other` */
+    void swap_map(inode_t &other);
 
   protected:
-    /* fill content from inode with number `ino` on disk */
-    int fill();
+    /* a reference to `ic` itself, see scratch() */
+    explicit inode_t(icnode_t *ic);
+
+    /* holes read as zeros with blkno 0, unless `alloc` fills them in */
+    int get_blk(size_t n, blkbuf_t *blkbuf, bool alloc = false);
+    /* read the file's data blocks [n, n + k) as one batch */
+    int get_blks(size_t n, size_t k, blkbuf_t *bufs, bool alloc = false);
 
-    int get_blk(size_t n, blkbuf_t *blkbuf);
+    /*
+     * called by read() for its blocks [first, last]: on sequential access,
+     * load the next window into the buffer cache and hint the disk about the
+     * one after, doubling the window each time up to RA_MAX_BLKS; what it
+     * maps is kept in `fs` for the reads to come
+     */
+    void readahead(size_t first, size_t last, fstate_t *fs);
+    /* all data and mapping blocks are allocated and freed through these */
+    uint32_t balloc(size_t goal = 0);
+    void bfree(uint32_t blkno);
 
-    /* get the file's nth data block number on the block device */
-    uint32_t blk_walk(size_t n, bool alloc = false, bool free = false);
+    /*
+     * the mapping block holding the link of logical block `m` (past the
+     * direct links), pinned; the link is at index
+     * (m - DIRECT_BLKS_PER_INODE) % INDRECT_LINK_PER_BLK in it
+     * nullptr for a hole, unless `alloc`, which allocates missing mapping
+     * blocks near `goal`; `err` is set on failure
+     */
+    buf_t *map_leaf(size_t m, bool alloc, uint32_t goal, bool &err);
+    /* interior mapping block `blkno`, pinned, kept in the map cache */
+    buf_t *map_interior(uint32_t blkno);
+    /* a new, zeroed mapping block (0 if the volume is full) */
+    uint32_t map_new(uint32_t goal);
+    /*
+     * free what mapping block `blkno`, `depth` levels above the data and
+     * mapping logical blocks from `first` on, links at or past logical block
+     * `keep`, and the block itself if nothing is left
+     */
+    void map_trunc(uint32_t &blkno, int depth, size_t first, size_t keep);
+    /*
+     * map the file's data blocks [n, n + k) in one walk, consecutive blocks
+     * coming out as runs of consecutive block numbers
+     * unmapped blocks are 0 unless `alloc`, in which case they are allocated
+     * and zeroed; with `fresh`, they are flagged there instead of zeroed, and
+     * the caller has to write them as a whole
+     */
+    int blk_map(size_t n, size_t k, uint32_t *blknos, bool alloc = false,
+                uint8_t *fresh = nullptr);
+    /*
+     * the block mapped to logical block n, and in `len` how many blocks from
+     * n on are mapped contiguously (or, for a hole, are unmapped)
+     */
+    uint32_t ext_lookup(size_t n, size_t &len);
+    /*
+     * the block mapped to logical block n of an extent mapped inode; with
+     * `alloc`, a hole is filled with a new block, which is not zeroed
+     */
+    uint32_t ext_walk(size_t n, bool alloc);
+    /*
+     * make room for one more extent in the leaf of logical block n, one
+     * split (or one more level) at a time: a caller finding the leaf still
+     * full looks it up again and calls once more
+     */
+    int ext_grow(size_t n);
+    /*
+     * free what the extent tree node `hdr`, `ents` maps from logical block
+     * `keep` on, walking only the extents and nodes past it; nodes below
+     * it left empty are freed, and whether it changed is returned
+     */
+    bool ext_trunc(extent_hdr *hdr, extent_t *ents, size_t keep);
 
     void destory();
 };
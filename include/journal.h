@@ -0,0 +1,114 @@
+#ifndef AQFS_JOURNAL_H
+#define AQFS_JOURNAL_H
+
+#include "paras.h"
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+
+namespace aqfs {
+
+/*
+ * blocks aqfs.mkfs sets aside for the journal, at the end of the volume:
+ * 1/256 of it, within these bounds
+ */
+const uint32_t JOURNAL_BLKS = 256;
+const uint32_t JOURNAL_MAX_BLKS = 2048;
+
+const uint32_t JOURNAL_HDR_MAGIC = 0x4a6e6c48;
+const uint32_t JOURNAL_COMMIT_MAGIC = 0x4a6e6c43;
+/* blocks one transaction can log, as many as its header has room for */
+const uint32_t JOURNAL_HDR_LINKS = (BLKSIZE - 16) / sizeof(uint32_t);
+
+/*
+ * a transaction in the log: the header, copies of the blocks it names, then
+ * the commit block; it counts only with a commit block of the same seq whose
+ * sum matches the header and the copies
+ */
+struct jheader {
+    uint32_t magic;
+    uint32_t nblks;
+    uint64_t seq;
+    uint32_t blknos[JOURNAL_HDR_LINKS];
+};
+static_assert(sizeof(struct jheader) <= BLKSIZE, "jheader too large");
+
+struct jcommit {
+    uint32_t magic;
+    uint32_t nblks;
+    uint64_t seq;
+    uint64_t sum;
+};
+
+/*
+ * the metadata journal
+ * a physical redo log of whole metadata blocks in the region described by
+ * the superblock; without one (volumes made before it, or a mapped image,
+ * which changes in place), commit() is a plain write back and sync
+ *
+ * operations that change the volume run in transactions (see txn_t), and all
+ * that run between two commits are committed together: commit() waits for
+ * the running ones to finish and holds new ones back, writes the in-core
+ * metadata to its blocks, and logs the dirty metadata blocks of the buffer
+ * cache with one sequential write; file data is written in place before
+ * that, so committed metadata never points at stale data
+ * logged blocks may then be written in place at any time; once the log is
+ * half full, all of them are, and the log starts over
+ * recover() replays the committed transactions at mount
+ */
+class journal_t {
+    uint32_t start = 0, len = 0; /* the log region, len 0 if none */
+    uint32_t head = 0;           /* next free log block */
+    uint64_t seq = 0;            /* of the last committed transaction */
+    uint32_t maxblks = 0;        /* blocks one transaction can log */
+
+    std::mutex lock;
+    std::condition_variable cv;
+    uint32_t nrunning = 0;  /* transactions in progress */
+    bool committing = false;
+
+    int write(struct buf_t **bufs, uint32_t n);
+    int checkpoint();
+
+  public:
+    uint64_t commits = 0, logged = 0; /* counters */
+
+    bool active() { return this->len != 0; }
+
+    /*
+     * replay what the superblock's log holds past its last checkpoint
+     * returns the number of transactions replayed, -1 on error
+     */
+    int recover();
+    /* start journaling (or not, for `mapped` images) after recover() */
+    void init(bool mapped);
+    /* checkpoint and stop journaling */
+    int fini();
+
+    /* a transaction begins / ends, see txn_t */
+    void begin();
+    void end();
+
+    /* make everything done so far durable */
+    int commit();
+};
+
+/*
+ * a transaction: one operation on the volume, from before its first lock to
+ * after its last unlock, so that a commit never sees it halfway
+ * transactions nest, the outermost one counts; like a batch, a checkpoint
+ * (and so a commit) is held back to its end
+ */
+class txn_t {
+    static thread_local int depth;
+
+  public:
+    txn_t();
+    ~txn_t();
+    txn_t(const txn_t &) = delete;
+    txn_t &operator=(const txn_t &) = delete;
+};
+
+} // namespace aqfs
+
+#endif
@@ -2,15 +2,26 @@
 #define AQFS_RUNTIME_H
 
 #include "base.h"
+#include "bcache.h"
+#include "dcache.h"
 #include "disk.h"
+#include "icache.h"
+#include "journal.h"
 
 namespace aqfs::Runtime {
 
 extern disk_t disk;
+extern bcache_t bcache;
+extern icache_t icache;
+extern dcache_t dcache;
 extern super_t super;
 extern bitmap_t bitmap;
+extern journal_t journal;
 
-int init(std::string disk_root);
+int init(std::string disk_root, bool mmap = false,
+         size_t nbufs = BCACHE_NBUFS);
+/* commit in-memory metadata and make the disk durable */
+int sync();
 int fini();
 
 } // namespace aqfs::Runtime
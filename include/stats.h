@@ -0,0 +1,210 @@
+#ifndef AQFS_STATS_H
+#define AQFS_STATS_H
+
+#include "disk.h"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace aqfs {
+
+/* the operations of aqfs.fuse that are counted and timed */
+enum stat_op {
+    STAT_GETATTR,
+    STAT_READLINK,
+    STAT_OPENDIR,
+    STAT_READDIR,
+    STAT_MKDIR,
+    STAT_UNLINK,
+    STAT_RMDIR,
+    STAT_SYMLINK,
+    STAT_RENAME,
+    STAT_LINK,
+    STAT_CHMOD,
+    STAT_TRUNCATE,
+    STAT_OPEN,
+    STAT_CREATE,
+    STAT_READ,
+    STAT_WRITE,
+    STAT_FSYNC,
+    STAT_RELEASE,
+    STAT_RELEASEDIR,
+    STAT_UTIMENS,
+    STAT_NOPS /* also: no operation, e.g. mount and unmount */
+};
+
+/* what a block of the volume holds, as far as block I/O is concerned */
+enum blk_class {
+    BLK_SUPER, /* the boot and super blocks */
+    BLK_BITMAP,
+    BLK_INODE,
+    BLK_DIR,
+    BLK_INDIRECT, /* indirect blocks and extent leaves */
+    BLK_DATA,
+    BLK_JOURNAL,
+    BLK_NCLASSES
+};
+
+/* block I/O calls of disk_t */
+enum io_op { IO_READ, IO_WRITE, IO_SYNC, IO_NOPS };
+
+const char *stat_name(stat_op op);
+const char *blk_class_name(blk_class c);
+
+/* latency buckets: bucket i counts calls of [2^(i-1), 2^i) ns, 0 of 0 ns */
+const int STAT_BUCKETS = 40;
+
+/*
+ * the call count and latency histogram of one kind of call
+ * add() only adds to relaxed atomics, so callers running in parallel never
+ * wait for each other; a reader may see a call counted in one field and not
+ * yet in another
+ */
+struct stat_hist_t {
+    std::atomic<uint64_t> calls{0}, errors{0}, total_ns{0}, max_ns{0};
+    std::atomic<uint64_t> buckets[STAT_BUCKETS] = {};
+
+    void add(uint64_t ns, bool error);
+};
+
+/* per-operation call counts and latency histograms of aqfs.fuse */
+class stats_t {
+    stat_hist_t ops[STAT_NOPS];
+
+  public:
+    void record(stat_op op, uint64_t ns, bool error) {
+        this->ops[op].add(ns, error);
+    }
+    /*
+     * a table of every operation called so far, then their histograms,
+     * then the block I/O of iostat
+     */
+    std::string dump() const;
+};
+
+/*
+ * a record of the block I/O trace, in host byte order
+ * every block read or written is one record, stamped with the start of
+ * its disk_t call and the operation of the thread that made it; the end of
+ * every operation is one more, with op TRACE_DONE and its result in
+ * `arg`, which for read and write is the bytes asked for that were done
+ */
+struct trace_rec {
+    uint64_t ns;   /* steady clock */
+    uint32_t arg;  /* the block, or the result of a TRACE_DONE */
+    uint8_t op;    /* io_op, or TRACE_DONE */
+    uint8_t cls;   /* blk_class of the block */
+    uint8_t fop;   /* stat_op, STAT_NOPS outside any */
+    uint8_t pad;
+};
+const uint8_t TRACE_DONE = 0xff;
+
+/*
+ * block I/O accounting of disk_t: blocks read and written by class, the
+ * latency of every call, and optionally a trace of trace_rec to a file
+ * disk_t knows where the bitmaps, the inode table and the journal are
+ * from the superblock; the blocks in the data area that hold directories
+ * or block maps are tagged by the inode layer when it uses them, and
+ * untagged when they are freed
+ */
+class iostat_t {
+    std::atomic<uint64_t> blks[IO_NOPS][BLK_NCLASSES] = {};
+    stat_hist_t calls[IO_NOPS];
+
+    std::mutex taglock;
+    std::unordered_map<uint32_t, uint8_t> tags;
+
+    std::mutex tracelock;
+    int tracefd = -1;
+    std::vector<trace_rec> trace; /* records not yet written out */
+    std::atomic<bool> tracing{false};
+
+    void trace_flush();
+
+  public:
+    void tag(uint32_t blkno, blk_class c);
+    void untag(uint32_t blkno);
+    blk_class classify(uint32_t blkno);
+
+    /* a disk_t call on `n` blocks that began at `start` and took `ns` */
+    void record(io_op op, const blkio_t *ios, size_t n, uint64_t start,
+                uint64_t ns);
+    /* the end of an operation, for the trace */
+    void done(stat_op op, int res);
+
+    /* trace to file `path` from now on */
+    int trace_open(const char *path);
+    void trace_close();
+
+    friend class stats_t;
+};
+
+extern stats_t stats;
+extern iostat_t iostat;
+/* the operation this thread is in */
+extern thread_local stat_op stat_cur;
+
+inline uint64_t stat_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+/*
+ * `f` counted and timed as operation STAT_`op`, a negative result counting
+ * as an error; with AQFS_STATS undefined it is `f` itself, so a build
+ * without statistics pays nothing for them
+ */
+#ifdef AQFS_STATS
+#define STAT_OP(op, f) (&aqfs::stat_timed<aqfs::STAT_##op, f>::call)
+#else
+#define STAT_OP(op, f) (f)
+#endif
+
+template <stat_op OP, auto F> struct stat_timed;
+
+template <stat_op OP, typename... A, int (*F)(A...)>
+struct stat_timed<OP, F> {
+    static int call(A... args) {
+        stat_op outer = stat_cur;
+        stat_cur = OP;
+        uint64_t start = stat_now();
+        int res = F(args...);
+        stats.record(OP, stat_now() - start, res < 0);
+        iostat.done(OP, res);
+        stat_cur = outer;
+        return res;
+    }
+};
+
+/*
+ * a disk_t call, accounted when it returns; calls made from within one
+ * (a batch falling back to single blocks) are part of it
+ */
+class io_timer_t {
+    static thread_local int depth;
+    io_op op;
+    const blkio_t *ios;
+    size_t n;
+    uint64_t start = 0;
+
+  public:
+    io_timer_t(io_op op, const blkio_t *ios = nullptr, size_t n = 0)
+        : op(op), ios(ios), n(n) {
+        if (this->depth++ == 0)
+            this->start = stat_now();
+    }
+    ~io_timer_t() {
+        if (--this->depth == 0)
+            iostat.record(this->op, this->ios, this->n, this->start,
+                          stat_now() - this->start);
+    }
+};
+
+} // namespace aqfs
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef AQFS_URING_H
+#define AQFS_URING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace aqfs {
+
+/*
+ * a minimal io_uring, driven by raw syscalls
+ * init() fails on kernels or sandboxes without io_uring, callers should then
+ * fall back to synchronous I/O
+ */
+class uring_t {
+    int fd = -1;
+    unsigned entries = 0;
+    unsigned pending = 0; /* submitted but not yet reaped */
+
+    /* submission queue */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    ::io_uring_sqe *sqes;
+    /* completion queue */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    ::io_uring_cqe *cqes;
+
+    void *sq_ptr = nullptr, *cq_ptr = nullptr;
+    size_t sq_size = 0, cq_size = 0, sqes_size = 0;
+
+  public:
+    int init(unsigned entries);
+    void fini();
+    bool ok() { return this->fd >= 0; }
+    unsigned depth() { return this->entries; }
+
+    /*
+     * queue a readv/writev of `n` iovecs on `fd` at `off`
+     * `data` is handed back with the completion
+     * returns -1 when the submission queue is full
+     */
+    int prep(bool write, int fd, const struct iovec *iov, unsigned n,
+             off_t off, uint64_t data);
+    /* submit queued entries, wait for all pending ones and reap them */
+    int submit_and_wait(uint64_t *data, int *res, unsigned max);
+};
+
+} // namespace aqfs
+
+#endif
@@ -1,19 +1,19 @@
 #include "base.h"
-#include "disk.h"
 #include "runtime.h"
 #include <cstring>
+#include <map>
 
 namespace aqfs {
 
 int blkbuf_t::fill() {
-    int res = Runtime::disk.read(this->blkno, this->data);
+    int res = Runtime::bcache.read(this->blkno, this->data);
     if (res != 0)
         return -1;
     return 0;
 }
 
 int blkbuf_t::persist() {
-    int res = Runtime::disk.write(this->blkno, this->data);
+    int res = Runtime::bcache.write(this->blkno, this->data);
     if (res != 0)
         return -1;
     return 0;
@@ -21,38 +21,180 @@ int blkbuf_t::persist() {
 
 int super_t::load() {
     char buf[BLKSIZE];
-    int res = Runtime::disk.read(BASE_SUPER_BLK, buf);
+    int res = Runtime::bcache.read(BASE_SUPER_BLK, buf);
     if (res != 0)
         return -1;
     std::memcpy(this, buf, sizeof(super_t));
+
+    /* the fixed layout: both maps in one block, the imap first */
+    if (this->nblks == 0) {
+        this->blksize = BLKSIZE;
+        this->nblks = N_DBLKS;
+        this->ninodes = N_INODES;
+        this->imap_start = this->dmap_start = BASE_BITMAP_BLK;
+        this->inode_start = BASE_INODE_BLK;
+        this->data_start = BASE_DATA_BLKS;
+    }
+    if (this->izeroed == 0)
+        this->izeroed = this->ninodes / INODES_PER_BLK;
     return 0;
 }
 
+/* `izeroed` only grows, under this lock */
+static std::mutex izero_lock;
+
 int super_t::persist() {
     char buf[BLKSIZE] = {0};
-    std::memcpy(buf, this, sizeof(super_t));
-    int res = Runtime::disk.write(BASE_SUPER_BLK, buf);
+    {
+        /* an inode load may be moving `izeroed` on meanwhile */
+        std::lock_guard<std::mutex> l(izero_lock);
+        std::memcpy(buf, this, sizeof(super_t));
+    }
+    int res = Runtime::bcache.write(BASE_SUPER_BLK, buf);
     if (res != 0)
         return res;
     return 0;
 }
 
+int super_t::izero(uint32_t ino) {
+    std::lock_guard<std::mutex> l(izero_lock);
+    for (; this->izeroed <= ino / INODES_PER_BLK; this->izeroed++) {
+        buf_t *b =
+            Runtime::bcache.get(this->inode_start + this->izeroed, false);
+        if (b == nullptr)
+            return -1;
+        memset(b->data, 0, BLKSIZE);
+        Runtime::bcache.put(b, true);
+    }
+    return 0;
+}
+
+/* copy `len` bytes at byte `pos` of the volume out of the cache */
+static int read_bytes(uint64_t pos, char *buf, size_t len) {
+    while (len > 0) {
+        size_t off = pos % BLKSIZE, n = std::min(len, BLKSIZE - off);
+        buf_t *b = Runtime::bcache.get(pos / BLKSIZE);
+        if (b == nullptr)
+            return -1;
+        std::memcpy(buf, b->data + off, n);
+        Runtime::bcache.put(b);
+        pos += n, buf += n, len -= n;
+    }
+    return 0;
+}
+
+/* and into it */
+static int write_bytes(uint64_t pos, const char *buf, size_t len) {
+    while (len > 0) {
+        size_t off = pos % BLKSIZE, n = std::min(len, BLKSIZE - off);
+        buf_t *b = Runtime::bcache.get(pos / BLKSIZE, n != BLKSIZE);
+        if (b == nullptr)
+            return -1;
+        std::memcpy(b->data + off, buf, n);
+        Runtime::bcache.put(b, true);
+        pos += n, buf += n, len -= n;
+    }
+    return 0;
+}
+
+/*
+ * each map starts a block of its own; in the fixed layout the dmap follows
+ * the imap in the same block
+ */
+static uint64_t imap_pos() {
+    return (uint64_t)Runtime::super.imap_start * BLKSIZE;
+}
+
+static uint64_t dmap_pos(bitset &imap) {
+    if (Runtime::super.dmap_start == Runtime::super.imap_start)
+        return imap_pos() + imap.size();
+    return (uint64_t)Runtime::super.dmap_start * BLKSIZE;
+}
+
+void bitmap_t::init() {
+    std::lock_guard<std::mutex> l(this->lock);
+    this->imap = bitset(Runtime::super.ninodes);
+    this->dmap = bitset(Runtime::super.nblks);
+}
+
 int bitmap_t::load() {
-    char buf[BLKSIZE];
-    int res = Runtime::disk.read(BASE_BITMAP_BLK, buf);
-    if (res != 0)
+    std::lock_guard<std::mutex> l(this->lock);
+    this->imap = bitset(Runtime::super.ninodes);
+    this->dmap = bitset(Runtime::super.nblks);
+    if (read_bytes(imap_pos(), this->imap.data(), this->imap.size()) != 0 ||
+        read_bytes(dmap_pos(this->imap), this->dmap.data(),
+                   this->dmap.size()) != 0)
         return -1;
-    std::memcpy(this, buf, sizeof(bitmap_t));
+    this->imap.recount();
+    this->dmap.recount();
     return 0;
 }
 
+/* only the blocks of the maps that changed since the last time */
 int bitmap_t::persist() {
-    char buf[BLKSIZE] = {0};
-    std::memcpy(buf, this, sizeof(bitmap_t));
-    int res = Runtime::disk.write(BASE_BITMAP_BLK, buf);
-    if (res != 0)
-        return res;
+    std::vector<std::pair<uint64_t, std::vector<char>>> pieces;
+    {
+        std::lock_guard<std::mutex> l(this->lock);
+        uint64_t pos[2] = {imap_pos(), dmap_pos(this->imap)};
+        bitset *maps[2] = {&this->imap, &this->dmap};
+        /* pieces with deferred frees, which are written out free */
+        std::map<size_t, std::vector<uint32_t>> frees;
+        for (uint32_t blkno : this->freed)
+            frees[blkno / 8 / BLKSIZE].push_back(blkno);
+        this->npersisted = this->freed.size();
+        for (int m = 0; m < 2; m++)
+            for (size_t k = 0; k < maps[m]->pieces(); k++) {
+                auto f = m == 1 ? frees.find(k) : frees.end();
+                if (!maps[m]->take_changed(k) && f == frees.end())
+                    continue;
+                size_t off = k * BLKSIZE;
+                size_t n = std::min((size_t)BLKSIZE, maps[m]->size() - off);
+                const char *p = maps[m]->data() + off;
+                pieces.push_back({pos[m] + off, std::vector<char>(p, p + n)});
+                if (f == frees.end())
+                    continue;
+                for (uint32_t blkno : f->second) {
+                    size_t bit = blkno - off * 8;
+                    pieces.back().second[bit / 8] &= ~(1 << (bit % 8));
+                }
+            }
+    }
+    for (auto &p : pieces)
+        if (write_bytes(p.first, p.second.data(), p.second.size()) != 0)
+            return -1;
     return 0;
 }
 
+uint32_t bitmap_t::alloc_ino() {
+    std::lock_guard<std::mutex> l(this->lock);
+    return this->imap.alloc();
+}
+
+void bitmap_t::free_ino(uint32_t ino) {
+    std::lock_guard<std::mutex> l(this->lock);
+    this->imap.reset(ino);
+}
+
+uint32_t bitmap_t::alloc_blk(size_t goal, size_t n, size_t *got) {
+    std::lock_guard<std::mutex> l(this->lock);
+    return this->dmap.alloc(goal, n, got);
+}
+
+void bitmap_t::free_blk(uint32_t blkno) {
+    std::lock_guard<std::mutex> l(this->lock);
+    if (this->defer)
+        this->freed.push_back(blkno);
+    else
+        this->dmap.reset(blkno);
+}
+
+void bitmap_t::release() {
+    std::lock_guard<std::mutex> l(this->lock);
+    for (size_t i = 0; i < this->npersisted; i++)
+        this->dmap.reset(this->freed[i]);
+    this->freed.erase(this->freed.begin(),
+                      this->freed.begin() + this->npersisted);
+    this->npersisted = 0;
+}
+
 } // namespace aqfs
@@ -0,0 +1,413 @@
+#include "bcache.h"
+#include "runtime.h"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace aqfs {
+
+thread_local int bcache_t::batch = 0;
+
+void bcache_t::init(size_t nbufs) {
+    this->nbufs = nbufs > 0 ? nbufs : 1;
+    this->flushed = time(nullptr);
+    this->hits = this->misses = this->evictions = this->writebacks = 0;
+    this->readaheads = 0;
+}
+
+int bcache_t::fini() {
+    int res = this->flush();
+    for (auto &it : this->table)
+        delete it.second;
+    this->table.clear();
+    this->lru.clear();
+    return res;
+}
+
+/*
+ * uncommitted metadata stays, and so do buffers flush() is writing back
+ * (which are left in the LRU list)
+ */
+static bool evictable(buf_t *b) { return !b->meta && !b->loading; }
+
+/*
+ * with the cache full and its coldest evictable buffer dirty, write back a
+ * cluster of dirty buffers from the cold end, so that alloc() finds a clean
+ * one; the write is done without the lock, the buffers pinned and flagged
+ * `loading` meanwhile, so that nobody changes or evicts them
+ * returns 1 if the lock was dropped, 0 if there was nothing to do, -1 if
+ * the write failed
+ */
+int bcache_t::room(std::unique_lock<std::mutex> &l) {
+    if (this->table.size() < this->nbufs)
+        return 0;
+    auto victim = std::find_if(this->lru.begin(), this->lru.end(), evictable);
+    if (victim == this->lru.end() || !(*victim)->dirty)
+        return 0;
+    std::vector<buf_t *> wb;
+    for (auto it = victim; it != this->lru.end() && wb.size() < BCACHE_WB_BATCH;
+         it++)
+        if ((*it)->dirty && evictable(*it))
+            wb.push_back(*it);
+    std::vector<blkio_t> ios;
+    for (buf_t *b : wb) {
+        this->lru.erase(b->lru);
+        b->pin = 1;
+        b->loading = true;
+        ios.push_back({b->blkno, b->data});
+    }
+    std::sort(ios.begin(), ios.end(), [](const blkio_t &a, const blkio_t &b) {
+        return a.blkno < b.blkno;
+    });
+
+    l.unlock();
+    int res = Runtime::disk.writev(ios.data(), ios.size());
+    l.lock();
+    /* back at the cold end, in the order they were taken from it */
+    for (size_t i = wb.size(); i-- > 0;) {
+        buf_t *b = wb[i];
+        b->loading = false;
+        if (res == 0)
+            b->dirty = false;
+        if (--b->pin == 0) {
+            this->lru.push_front(b);
+            b->lru = this->lru.begin();
+        }
+    }
+    this->loaded.notify_all();
+    if (res != 0)
+        return -1;
+    this->writebacks += wb.size();
+    return 1;
+}
+
+/* find a buffer for `blkno`: a new one while below nbufs, else the LRU one */
+buf_t *bcache_t::alloc(uint32_t blkno) {
+    buf_t *b = nullptr;
+    if (this->table.size() >= this->nbufs) {
+        /* if nothing can go, the cache grows past nbufs */
+        auto victim =
+            std::find_if(this->lru.begin(), this->lru.end(), evictable);
+        /* room() has written it back */
+        if (victim != this->lru.end() && !(*victim)->dirty) {
+            b = *victim;
+            this->lru.erase(victim);
+            this->table.erase(b->blkno);
+            this->evictions++;
+        }
+    }
+    if (b == nullptr)
+        b = new buf_t;
+
+    b->blkno = blkno;
+    b->pin = 1;
+    b->dirty = false;
+    b->loading = false;
+    b->valid = true;
+    b->meta = false;
+    char *addr = Runtime::disk.blkaddr(blkno);
+    b->data = addr ? addr : b->mem;
+    this->table[blkno] = b;
+    return b;
+}
+
+/* a buffer that could not be read in is dropped with its last pin */
+void bcache_t::unpin(buf_t *b) {
+    if (--b->pin > 0)
+        return;
+    if (!b->valid) {
+        this->table.erase(b->blkno);
+        delete b;
+        return;
+    }
+    this->lru.push_back(b);
+    b->lru = std::prev(this->lru.end());
+}
+
+buf_t *bcache_t::get(uint32_t blkno, bool fill) {
+    std::unique_lock<std::mutex> l(this->lock);
+    auto it = this->table.find(blkno);
+    /* making room drops the lock, after which the block may be in */
+    int r = 0;
+    while (it == this->table.end() && (r = this->room(l)) > 0)
+        it = this->table.find(blkno);
+    if (it != this->table.end()) {
+        buf_t *b = it->second;
+        if (b->pin++ == 0)
+            this->lru.erase(b->lru);
+        this->hits++;
+        /* another thread is reading it in */
+        this->loaded.wait(l, [b] { return !b->loading; });
+        if (!b->valid) {
+            this->unpin(b);
+            return nullptr;
+        }
+        return b;
+    }
+
+    if (r < 0)
+        return nullptr;
+    this->misses++;
+    buf_t *b = this->alloc(blkno);
+    if (!fill || b->data != b->mem)
+        return b;
+    b->loading = true;
+    l.unlock();
+    int res = Runtime::disk.read(blkno, b->data);
+    l.lock();
+    b->loading = false;
+    b->valid = res == 0;
+    this->loaded.notify_all();
+    if (!b->valid) {
+        this->unpin(b);
+        return nullptr;
+    }
+    return b;
+}
+
+void bcache_t::put(buf_t *b, bool dirty, bool data) {
+    {
+        std::lock_guard<std::mutex> l(this->lock);
+        /* a mapped block is changed in place */
+        if (dirty && b->data == b->mem)
+            b->dirty = true;
+        /*
+         * data written to a block still in the log is logged too, or a
+         * replay would put the block's old content back over it
+         */
+        if (dirty && this->commit_at && !b->meta &&
+            (!data || this->logged.count(b->blkno))) {
+            b->meta = true;
+            this->nmeta++;
+        }
+        this->unpin(b);
+        if (dirty)
+            this->changed = true;
+    }
+    if (dirty && this->batch == 0)
+        this->checkpoint();
+}
+
+/* periodic checkpoint, including the in-core metadata */
+void bcache_t::checkpoint() {
+    {
+        std::lock_guard<std::mutex> l(this->lock);
+        bool full = this->commit_at && this->nmeta >= this->commit_at;
+        if (!this->changed ||
+            (time(nullptr) - this->flushed < BCACHE_FLUSH_INTERVAL && !full))
+            return;
+        this->changed = false;
+        this->flushed = time(nullptr);
+    }
+    Runtime::sync();
+}
+
+void bcache_t::end_batch() {
+    if (--this->batch == 0)
+        this->checkpoint();
+}
+
+int bcache_t::read(uint32_t blkno, char *buf) {
+    buf_t *b = this->get(blkno);
+    if (b == nullptr)
+        return -1;
+    memcpy(buf, b->data, BLKSIZE);
+    this->put(b);
+    return 0;
+}
+
+int bcache_t::write(uint32_t blkno, const char *buf, bool data) {
+    buf_t *b = this->get(blkno, false);
+    if (b == nullptr)
+        return -1;
+    memcpy(b->data, buf, BLKSIZE);
+    this->put(b, true, data);
+    return 0;
+}
+
+/*
+ * pin the blocks of `blknos` (only the missing ones unless `cached`) into
+ * `bufs`, which has to come zeroed, reading the missing ones in as one
+ * batch without the lock; what could not be had is left nullptr
+ */
+int bcache_t::pin(const uint32_t *blknos, size_t n, buf_t **bufs,
+                  bool cached) {
+    std::vector<blkio_t> misses;
+    std::vector<buf_t *> loading;
+    int res = 0;
+    std::unique_lock<std::mutex> l(this->lock);
+    for (size_t i = 0; i < n; i++) {
+        auto it = this->table.find(blknos[i]);
+        int r = 0;
+        while (it == this->table.end() && (r = this->room(l)) > 0)
+            it = this->table.find(blknos[i]);
+        if (r < 0) {
+            res = -1;
+            break;
+        }
+        if (it != this->table.end()) {
+            if (!cached)
+                continue;
+            bufs[i] = it->second;
+            if (bufs[i]->pin++ == 0)
+                this->lru.erase(bufs[i]->lru);
+            this->hits++;
+            continue;
+        }
+        if (cached)
+            this->misses++;
+        bufs[i] = this->alloc(blknos[i]);
+        if (bufs[i]->data != bufs[i]->mem)
+            continue;
+        bufs[i]->loading = true;
+        loading.push_back(bufs[i]);
+        misses.push_back({blknos[i], bufs[i]->data});
+    }
+
+    l.unlock();
+    bool ok = Runtime::disk.readv(misses.data(), misses.size()) == 0;
+    l.lock();
+    for (buf_t *b : loading) {
+        b->loading = false;
+        b->valid = ok;
+    }
+    this->loaded.notify_all();
+
+    /* wait for the blocks other threads were reading in */
+    for (size_t i = 0; i < n; i++) {
+        buf_t *b = bufs[i];
+        if (b == nullptr)
+            continue;
+        this->loaded.wait(l, [b] { return !b->loading; });
+        if (!b->valid) {
+            this->unpin(b);
+            bufs[i] = nullptr;
+            res = -1;
+        }
+    }
+    return res;
+}
+
+int bcache_t::readv(const blkio_t *ios, size_t n) {
+    std::vector<uint32_t> blknos(n);
+    std::vector<buf_t *> bufs(n);
+    for (size_t i = 0; i < n; i++)
+        blknos[i] = ios[i].blkno;
+    int res = this->pin(blknos.data(), n, bufs.data(), true);
+
+    if (res == 0)
+        for (size_t i = 0; i < n; i++)
+            memcpy(ios[i].buf, bufs[i]->data, BLKSIZE);
+    std::lock_guard<std::mutex> l(this->lock);
+    for (size_t i = 0; i < n; i++)
+        if (bufs[i])
+            this->unpin(bufs[i]);
+    return res;
+}
+
+int bcache_t::prefetch(const uint32_t *blknos, size_t n) {
+    std::vector<buf_t *> bufs(n);
+    int res = this->pin(blknos, n, bufs.data(), false);
+
+    std::lock_guard<std::mutex> l(this->lock);
+    for (size_t i = 0; i < n; i++)
+        if (bufs[i]) {
+            this->unpin(bufs[i]);
+            this->readaheads++;
+        }
+    return res;
+}
+
+int bcache_t::writev(const blkio_t *ios, size_t n, bool data) {
+    int res = 0;
+    this->begin_batch();
+    for (size_t i = 0; i < n && res == 0; i++)
+        res = this->write(ios[i].blkno, ios[i].buf, data);
+    this->end_batch();
+    return res;
+}
+
+/*
+ * the dirty buffers are flagged `loading` and written without the lock, so
+ * that misses go on meanwhile; they count as clean from the start, so that
+ * a change made meanwhile dirties them again, and `loading` keeps them from
+ * being evicted or pinned anew while leaving their place in the LRU list
+ * buffers room() is writing back are waited for; a failed one stays dirty
+ */
+int bcache_t::flush() {
+    std::unique_lock<std::mutex> l(this->lock);
+    std::vector<buf_t *> dirty, busy;
+    for (auto &it : this->table) {
+        buf_t *b = it.second;
+        if (!b->dirty || b->meta)
+            continue;
+        if (b->loading) {
+            /* pinned by room(), which puts it back in the LRU list */
+            b->pin++;
+            busy.push_back(b);
+            continue;
+        }
+        b->loading = true;
+        b->dirty = false;
+        dirty.push_back(b);
+    }
+    this->flushed = time(nullptr);
+    this->changed = false;
+
+    std::sort(dirty.begin(), dirty.end(),
+              [](buf_t *a, buf_t *b) { return a->blkno < b->blkno; });
+    std::vector<blkio_t> ios(dirty.size());
+    for (size_t i = 0; i < dirty.size(); i++)
+        ios[i] = {dirty[i]->blkno, dirty[i]->data};
+    l.unlock();
+    int res = Runtime::disk.writev(ios.data(), ios.size());
+    l.lock();
+    for (buf_t *b : dirty) {
+        b->loading = false;
+        if (res != 0)
+            b->dirty = true;
+    }
+    this->loaded.notify_all();
+    if (res == 0)
+        this->writebacks += dirty.size();
+
+    for (buf_t *b : busy) {
+        this->loaded.wait(l, [b] { return !b->loading; });
+        this->unpin(b);
+    }
+    return res == 0 ? 0 : -1;
+}
+
+void bcache_t::pin_meta(std::vector<buf_t *> &bufs) {
+    std::lock_guard<std::mutex> l(this->lock);
+    for (auto &it : this->table) {
+        buf_t *b = it.second;
+        if (!b->meta)
+            continue;
+        if (b->pin++ == 0)
+            this->lru.erase(b->lru);
+        bufs.push_back(b);
+    }
+    std::sort(bufs.begin(), bufs.end(),
+              [](buf_t *a, buf_t *b) { return a->blkno < b->blkno; });
+}
+
+void bcache_t::unpin_meta(std::vector<buf_t *> &bufs, bool committed) {
+    std::lock_guard<std::mutex> l(this->lock);
+    for (buf_t *b : bufs) {
+        /* still dirty, now free to be written in place */
+        if (committed) {
+            b->meta = false;
+            this->nmeta--;
+            this->logged.insert(b->blkno);
+        }
+        this->unpin(b);
+    }
+}
+
+void bcache_t::clear_logged() {
+    std::lock_guard<std::mutex> l(this->lock);
+    this->logged.clear();
+}
+
+} // namespace aqfs
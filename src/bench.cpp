@@ -0,0 +1,471 @@
+#include "dir.h"
+#include "journal.h"
+#include "runtime.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * aqfs_bench: benchmarks of the library's metadata and data paths, run on
+ * a scratch volume made by aqfs.mkfs, with no FUSE mount
+ * every operation is timed on its own; the results go to stdout as JSON,
+ * progress to stderr
+ * everything is done under a directory of its own, removed at the end
+ */
+
+using namespace aqfs;
+typedef std::chrono::steady_clock clk;
+
+static std::string volume;
+static size_t nbufs = BCACHE_NBUFS;
+static bool quick = false;         /* smaller runs, for CI */
+static const char *only = nullptr; /* run the benchmarks with this prefix */
+static std::mt19937_64 rng(1);
+
+/* the results of one benchmark */
+struct result_t {
+    std::string name;
+    std::string params;       /* a JSON object */
+    std::vector<uint64_t> ns; /* latency of each operation */
+    double secs = 0;          /* wall time of all of them */
+    uint64_t bytes = 0;       /* data moved, if any */
+    uint64_t entries = 0;     /* directory entries gone through, if any */
+    size_t errors = 0;
+};
+static std::vector<result_t> results;
+
+static bool selected(const char *name) {
+    return only == nullptr || strncmp(name, only, strlen(only)) == 0;
+}
+
+/*
+ * run `op(i)` for i in [0, n), timing each call; `setup(i)` runs before
+ * each one, untimed
+ * returns the result, which stays valid until the next measure()
+ */
+static result_t &measure(const char *name, const std::string &params,
+                         size_t n, std::function<int(size_t)> op,
+                         std::function<void(size_t)> setup = nullptr) {
+    results.emplace_back();
+    result_t &r = results.back();
+    r.name = name;
+    r.params = params;
+    r.ns.reserve(n);
+    fprintf(stderr, "%s %s\n", name, params.c_str());
+    for (size_t i = 0; i < n; i++) {
+        if (setup)
+            setup(i);
+        auto t = clk::now();
+        if (op(i) != 0)
+            r.errors++;
+        auto d = clk::now() - t;
+        r.ns.push_back(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+        r.secs += std::chrono::duration<double>(d).count();
+    }
+    return r;
+}
+
+static void report() {
+    printf("{\n  \"volume\": {\"blksize\": %u, \"blocks\": %u, "
+           "\"inodes\": %u, \"journal\": %s, \"nbufs\": %zu},\n",
+           Runtime::super.blksize, Runtime::super.nblks,
+           Runtime::super.ninodes,
+           Runtime::super.jlen ? "true" : "false", nbufs);
+    printf("  \"benchmarks\": [");
+    for (size_t i = 0; i < results.size(); i++) {
+        result_t &r = results[i];
+        std::vector<uint64_t> ns = r.ns;
+        std::sort(ns.begin(), ns.end());
+        auto pct = [&ns](double p) {
+            return ns.empty() ? 0 : ns[std::min(ns.size() - 1,
+                                                (size_t)(p * ns.size()))];
+        };
+        double total = r.secs > 0 ? r.secs : 1e-9;
+        printf("%s\n    {\"name\": \"%s\", \"params\": %s, \"ops\": %zu, "
+               "\"errors\": %zu, \"seconds\": %.6f, \"ops_per_sec\": %.1f",
+               i ? "," : "", r.name.c_str(), r.params.c_str(), ns.size(),
+               r.errors, r.secs, ns.size() / total);
+        if (r.bytes)
+            printf(", \"bytes_per_sec\": %.1f", r.bytes / total);
+        if (r.entries)
+            printf(", \"entries_per_sec\": %.1f", r.entries / total);
+        printf(",\n     \"latency_ns\": {\"mean\": %.0f, \"p50\": %lu, "
+               "\"p90\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}}",
+               ns.empty() ? 0.0 : r.secs * 1e9 / ns.size(), pct(0.5),
+               pct(0.9), pct(0.99), pct(0.999), ns.empty() ? 0 : ns.back());
+    }
+    printf("\n  ]\n}\n");
+}
+
+/* drop every cache: the next accesses go to disk */
+static int remount() {
+    Runtime::fini();
+    return Runtime::init(volume, false, nbufs);
+}
+
+/*
+ * the library's side of creating and removing a file or directory, as
+ * aqfs::fs does them, minus the locks: nothing else runs here
+ */
+static uint32_t mknode(dir_t &d, const char *name, bool isdir) {
+    txn_t t;
+    uint32_t ino = Runtime::bitmap.alloc_ino();
+    if (ino == 0)
+        return 0;
+    if (d.add(ino, name) != 0) {
+        Runtime::bitmap.free_ino(ino);
+        return 0;
+    }
+    dir_t node(ino);
+    node.zero();
+    node.setmode(isdir ? S_IFDIR | 0755 : S_IFREG | 0644);
+    node.addref();
+    if (isdir && (node.add(ino, ".") != 0 || node.add(d.getino(), "..") != 0))
+        return 0;
+    return ino;
+}
+
+static int rmnode(dir_t &d, const char *name) {
+    txn_t t;
+    uint32_t ino = d.lookup(name);
+    if (ino == 0)
+        return -1;
+    inode_t node(ino);
+    node.deref();
+    return d.remove(name);
+}
+
+static std::string entry_name(size_t i) { return "e" + std::to_string(i); }
+
+/*
+ * create, look up (with and without the dentry cache), scan and unlink the
+ * entries of a directory of `n` entries
+ */
+static void bench_dir(uint32_t tino, size_t n) {
+    dir_t top(tino);
+    std::string params = "{\"entries\": " + std::to_string(n) + "}";
+    std::string dname = "dir" + std::to_string(n);
+    uint32_t dino = mknode(top, dname.c_str(), true);
+    if (dino == 0) {
+        fprintf(stderr, "cannot make %s\n", dname.c_str());
+        return;
+    }
+    dir_t d(dino);
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++)
+        order[i] = i;
+
+    measure("dir.create", params, n, [&](size_t i) {
+        return mknode(d, entry_name(i).c_str(), false) != 0 ? 0 : -1;
+    });
+
+    std::shuffle(order.begin(), order.end(), rng);
+    Runtime::dcache.fini();
+    Runtime::dcache.init(DCACHE_NENTRIES);
+    measure("dir.lookup_uncached", params, n, [&](size_t i) {
+        return d.lookup(entry_name(order[i]).c_str()) != 0 ? 0 : -1;
+    });
+    measure("dir.lookup", params, n, [&](size_t i) {
+        return d.lookup(entry_name(order[i]).c_str()) != 0 ? 0 : -1;
+    });
+    measure("dir.lookup_absent", params, n, [&](size_t i) {
+        return d.lookup(("x" + entry_name(i)).c_str()) == 0 ? 0 : -1;
+    });
+
+    /* whole listings, as readdir streams them */
+    size_t nscans = std::max((size_t)3, (quick ? 20000 : 200000) / (n + 1));
+    uint64_t seen = 0;
+    result_t &scan =
+        measure("dir.scan", params, nscans, [&](size_t) {
+            std::vector<dirslot_t> slots;
+            size_t pos = 0;
+            int more;
+            while ((more = d.read(pos, slots)) == 1) {
+                seen += slots.size();
+                slots.clear();
+            }
+            seen += slots.size();
+            return more;
+        });
+    scan.entries = seen;
+
+    std::shuffle(order.begin(), order.end(), rng);
+    measure("dir.unlink", params, n, [&](size_t i) {
+        return rmnode(d, entry_name(order[i]).c_str());
+    });
+    {
+        txn_t t;
+        top.remove(dname.c_str());
+        d.deref();
+    }
+}
+
+/*
+ * sequential and random reads and writes of a `fsize` byte file, `bs`
+ * bytes at a time; reads start from a cold cache
+ */
+static void bench_file(uint32_t tino, size_t fsize, size_t bs) {
+    std::string params = "{\"file_size\": " + std::to_string(fsize) +
+                         ", \"io_size\": " + std::to_string(bs) + "}";
+    std::string fname = "file" + std::to_string(bs);
+    uint32_t ino;
+    {
+        dir_t top(tino);
+        ino = mknode(top, fname.c_str(), false);
+    }
+    if (ino == 0) {
+        fprintf(stderr, "cannot make %s\n", fname.c_str());
+        return;
+    }
+    size_t n = fsize / bs;
+    std::vector<char> buf(bs);
+    for (size_t i = 0; i < bs; i++)
+        buf[i] = 'a' + i % 26;
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++)
+        order[i] = i;
+    std::shuffle(order.begin(), order.end(), rng);
+
+    auto write = [&](size_t k) {
+        txn_t t;
+        inode_t f(ino);
+        return f.write(bs, k * bs, buf.data()) == (int)bs ? 0 : -1;
+    };
+    auto read = [&](size_t k) {
+        inode_t f(ino);
+        return f.read(bs, k * bs, buf.data()) == (int)bs ? 0 : -1;
+    };
+
+    measure("file.write_seq", params, n, write).bytes = fsize;
+    Runtime::sync();
+    measure("file.write_rand", params, n,
+            [&](size_t i) { return write(order[i]); })
+        .bytes = fsize;
+    Runtime::sync();
+
+    remount();
+    measure("file.read_seq", params, n, read).bytes = fsize;
+    remount();
+    measure("file.read_rand", params, n,
+            [&](size_t i) { return read(order[i]); })
+        .bytes = fsize;
+    dir_t top(tino);
+    rmnode(top, fname.c_str());
+}
+
+/*
+ * allocation on a fragmented volume: `n` blocks are taken, and then every
+ * other one and a random third of the rest given back
+ */
+static void bench_bitmap(size_t n) {
+    std::string params = "{\"fragmented_blocks\": " + std::to_string(n) + "}";
+    std::vector<uint32_t> frag, held;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t b = Runtime::bitmap.alloc_blk();
+        if (b == 0)
+            break;
+        frag.push_back(b);
+    }
+    std::vector<uint32_t> keep;
+    for (size_t i = 0; i < frag.size(); i++) {
+        if (i % 2 == 0 || rng() % 3 == 0)
+            Runtime::bitmap.free_blk(frag[i]);
+        else
+            keep.push_back(frag[i]);
+    }
+    /* deferred frees become free at a commit */
+    Runtime::sync();
+
+    uint32_t first = frag.empty() ? 0 : frag.front();
+    size_t span = frag.empty() ? 1 : frag.back() - first + 1;
+    measure("bitmap.alloc", params, n / 4, [&](size_t) {
+        uint32_t b = Runtime::bitmap.alloc_blk();
+        held.push_back(b);
+        return b ? 0 : -1;
+    });
+    measure("bitmap.alloc_near", params, n / 4, [&](size_t) {
+        uint32_t b = Runtime::bitmap.alloc_blk(first + rng() % span);
+        held.push_back(b);
+        return b ? 0 : -1;
+    });
+    uint64_t got_total = 0;
+    result_t &runs =
+        measure("bitmap.alloc_run", params, n / 64, [&](size_t) {
+            size_t got;
+            uint32_t b = Runtime::bitmap.alloc_blk(first + rng() % span, 16,
+                                                   &got);
+            for (size_t k = 0; b && k < got; k++)
+                held.push_back(b + k);
+            got_total += b ? got : 0;
+            return b ? 0 : -1;
+        });
+    runs.entries = got_total;
+
+    for (uint32_t b : held)
+        if (b)
+            Runtime::bitmap.free_blk(b);
+    for (uint32_t b : keep)
+        Runtime::bitmap.free_blk(b);
+    Runtime::sync();
+}
+
+/* resolving a path `depth` directories deep, the way fs walks it */
+static void bench_path(uint32_t tino, size_t depth, size_t n) {
+    std::string params = "{\"depth\": " + std::to_string(depth) + "}";
+    std::vector<uint32_t> chain = {tino};
+    std::string path;
+    for (size_t i = 0; i < depth; i++) {
+        dir_t d(chain.back());
+        std::string name = "level" + std::to_string(i);
+        uint32_t ino = mknode(d, name.c_str(), true);
+        if (ino == 0) {
+            fprintf(stderr, "cannot make %s\n", name.c_str());
+            break;
+        }
+        chain.push_back(ino);
+        path += "/" + name;
+    }
+
+    auto resolve = [&](size_t) {
+        dir_t d(chain.front());
+        size_t at = 1;
+        while (at < path.size()) {
+            size_t end = path.find('/', at);
+            if (end == std::string::npos)
+                end = path.size();
+            uint32_t ino = d.lookup(path.substr(at, end - at).c_str());
+            if (ino == 0)
+                return -1;
+            dir_t next(ino);
+            if (!S_ISDIR(next.getmode()))
+                return -1;
+            d = next;
+            at = end + 1;
+        }
+        return d.getino() == chain.back() ? 0 : -1;
+    };
+    measure("path.resolve", params, n, resolve);
+    measure("path.resolve_uncached", params, n / 10, resolve, [](size_t) {
+        Runtime::dcache.fini();
+        Runtime::dcache.init(DCACHE_NENTRIES);
+    });
+
+    for (size_t i = chain.size() - 1; i > 0; i--) {
+        dir_t d(chain[i - 1]);
+        std::string name = "level" + std::to_string(i - 1);
+        txn_t t;
+        d.remove(name.c_str());
+        dir_t(chain[i]).deref();
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-q] [-c nbufs] [-b benchmark] <block_root>\n"
+            "    -q            a quick run, with smaller sizes\n"
+            "    -c nbufs      blocks in the buffer cache (default %zu)\n"
+            "    -b benchmark  only those whose name starts with it: dir, "
+            "file, bitmap, path, ...\n"
+            "block_root is a scratch volume made by aqfs.mkfs; the results "
+            "go to stdout as JSON\n",
+            prog, BCACHE_NBUFS);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "qc:b:")) != -1) {
+        if (opt == 'q')
+            quick = true;
+        else if (opt == 'c')
+            nbufs = strtoul(optarg, nullptr, 0);
+        else if (opt == 'b')
+            only = optarg;
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    volume = argv[optind];
+    if (Runtime::init(volume, false, nbufs) != 0) {
+        fprintf(stderr, "failed to open %s\n", volume.c_str());
+        return 1;
+    }
+
+    /* everything under a directory of its own */
+    std::string tname = "aqfs_bench." + std::to_string(getpid());
+    uint32_t tino;
+    {
+        dir_t root(1);
+        tino = mknode(root, tname.c_str(), true);
+    }
+    if (tino == 0) {
+        fprintf(stderr, "cannot make /%s\n", tname.c_str());
+        Runtime::fini();
+        return 1;
+    }
+
+    std::vector<size_t> dirsizes = {10, 100, 1000, 10000, 100000};
+    if (quick)
+        dirsizes.resize(3);
+    for (size_t n : dirsizes) {
+        if (!selected("dir"))
+            break;
+        if (n + 16 > Runtime::bitmap.imap.count_free()) {
+            fprintf(stderr, "skipping a directory of %zu: too few inodes\n",
+                    n);
+            continue;
+        }
+        bench_dir(tino, n);
+    }
+
+    size_t fsize = (quick ? 8 : 64) << 20;
+    for (size_t bs : {4096, 65536, 1 << 20}) {
+        if (!selected("file"))
+            break;
+        if (fsize / BLKSIZE * 2 > Runtime::bitmap.dmap.count_free()) {
+            fprintf(stderr, "skipping files of %zu bytes: too few blocks\n",
+                    fsize);
+            break;
+        }
+        bench_file(tino, fsize, bs);
+    }
+
+    if (selected("bitmap"))
+        bench_bitmap(std::min(Runtime::bitmap.dmap.count_free() / 2,
+                              (size_t)(quick ? 1 << 14 : 1 << 18)));
+
+    for (size_t depth : {8, 64}) {
+        if (!selected("path"))
+            break;
+        bench_path(tino, quick ? depth / 4 : depth, quick ? 2000 : 20000);
+    }
+
+    {
+        txn_t t;
+        dir_t root(1);
+        root.remove(tname.c_str());
+        dir_t(tino).deref();
+    }
+    report();
+
+    /* a benchmark with errors measured something else: the run fails */
+    size_t failed = 0;
+    for (result_t &r : results)
+        if (r.errors) {
+            fprintf(stderr, "%s %s: %zu errors\n", r.name.c_str(),
+                    r.params.c_str(), r.errors);
+            failed++;
+        }
+    return Runtime::fini() == 0 && failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,77 @@
+#include "dcache.h"
+#include "paras.h"
+#include <cstring>
+
+namespace aqfs {
+
+/* names compare on their first MAX_FILENAME chars, like the directories */
+std::string dcache_t::key(uint32_t dir, const char *name) {
+    std::string k((const char *)&dir, sizeof(dir));
+    k.append(name, strnlen(name, MAX_FILENAME));
+    return k;
+}
+
+void dcache_t::init(size_t nentries) {
+    this->nentries = nentries > 0 ? nentries : 1;
+    this->hits = this->misses = 0;
+}
+
+void dcache_t::fini() {
+    std::lock_guard<std::mutex> l(this->lock);
+    this->table.clear();
+    this->lru.clear();
+}
+
+bool dcache_t::lookup(uint32_t dir, const char *name, uint32_t &ino) {
+    std::lock_guard<std::mutex> l(this->lock);
+    auto it = this->table.find(key(dir, name));
+    if (it == this->table.end()) {
+        this->misses++;
+        return false;
+    }
+    this->lru.splice(this->lru.begin(), this->lru, it->second);
+    this->hits++;
+    ino = it->second->ino;
+    return true;
+}
+
+void dcache_t::set(uint32_t dir, const char *name, uint32_t ino) {
+    std::lock_guard<std::mutex> l(this->lock);
+    std::string k = key(dir, name);
+    auto it = this->table.find(k);
+    if (it != this->table.end()) {
+        it->second->ino = ino;
+        this->lru.splice(this->lru.begin(), this->lru, it->second);
+        return;
+    }
+
+    this->lru.push_front({k, dir, ino});
+    this->table[k] = this->lru.begin();
+    while (this->lru.size() > this->nentries) {
+        this->table.erase(this->lru.back().key);
+        this->lru.pop_back();
+    }
+}
+
+void dcache_t::drop(uint32_t dir, const char *name) {
+    std::lock_guard<std::mutex> l(this->lock);
+    auto it = this->table.find(key(dir, name));
+    if (it == this->table.end())
+        return;
+    this->lru.erase(it->second);
+    this->table.erase(it);
+}
+
+void dcache_t::purge(uint32_t dir) {
+    std::lock_guard<std::mutex> l(this->lock);
+    for (auto it = this->lru.begin(); it != this->lru.end();) {
+        if (it->dir != dir) {
+            it++;
+            continue;
+        }
+        this->table.erase(it->key);
+        it = this->lru.erase(it);
+    }
+}
+
+} // namespace aqfs
@@ -1,4 +1,9 @@
 #include "dir.h"
+#include "runtime.h"
+#include <algorithm>
+#include <vector>
+#define MIN(a, b) ((a < b) ? a : b)
+#define MAX(a, b) ((a > b) ? a : b)
 
 namespace aqfs {
 
@@ -7,78 +12,207 @@ int namecmp(const char *s, const char *t) {
     return res;
 }
 
+/* FNV-1a over the significant part of the name */
+uint32_t namehash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < MAX_FILENAME && name[i]; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+bool dir_t::hashed(blkbuf_t &idx) {
+    if (this->getsize() < BLKSIZE || this->get_blk(0, &idx) != 0)
+        return false;
+    uint32_t magic = ((dir_index *)idx.data)->magic;
+    return magic == DIR_INDEX_MAGIC || magic == DIR_INDEX_MAGIC_V1;
+}
+
+bool dir_t::isindex(blkbuf_t &idx, size_t n) {
+    dir_index *index = (dir_index *)idx.data;
+    if (n == 0)
+        return true;
+    for (uint32_t p = 0; p < index->npages; p++)
+        if (index->page[p] == n)
+            return true;
+    return false;
+}
+
 uint32_t dir_t::lookup(const char *name) {
-    blkbuf_t dirblkbuf;
-    direntry *entries = (direntry *)dirblkbuf.data;
+    uint32_t ino;
+    if (Runtime::dcache.lookup(this->ino, name, ino))
+        return ino;
+
+    blkbuf_t idx;
+    if (this->hashed(idx)) {
+        ino = this->hlookup(idx, name);
+        if (ino != (uint32_t)-1)
+            Runtime::dcache.set(this->ino, name, ino);
+        return ino == (uint32_t)-1 ? 0 : ino;
+    }
+
+    std::vector<blkbuf_t> bufs(DIR_SCAN_BLKS);
+    size_t nblks = this->getsize() / BLKSIZE;
 
     // DIR 所占的 size 总是 BLKSIZE 的整数倍
-    // 每次读入一个 BLK 并在其中查找
+    // 每次读入 DIR_SCAN_BLKS 个 BLK 并在其中查找
     // 找到则返回其 ino
-    for (size_t n = 0; (n * BLKSIZE) < this->getsize(); n++) {
-        this->get_blk(n, &dirblkbuf);
-        for (int i = 0; i < DIRENTRY_PER_BLK; i++)
-            if (entries[i].ino == 0)
-                continue;
-            else if (namecmp(name, entries[i].name) == 0)
-                // entry matches name
-                return entries[i].ino;
+    for (size_t n = 0; n < nblks; n += DIR_SCAN_BLKS) {
+        size_t k = MIN(DIR_SCAN_BLKS, nblks - n);
+        if (this->get_blks(n, k, bufs.data()) != 0)
+            return 0;
+        for (size_t b = 0; b < k; b++) {
+            direntry *entries = (direntry *)bufs[b].data;
+            for (int i = 0; i < DIRENTRY_PER_BLK; i++)
+                if (entries[i].ino == 0)
+                    continue;
+                else if (namecmp(name, entries[i].name) == 0) {
+                    // entry matches name
+                    Runtime::dcache.set(this->ino, name, entries[i].ino);
+                    return entries[i].ino;
+                }
+        }
     }
 
-    // Not found, returns 0.
+    // Not found, remember that and return 0.
+    Runtime::dcache.set(this->ino, name, 0);
     return 0;
 }
 
-std::queue<struct direntry> dir_t::read() {
-    blkbuf_t dirblkbuf;
-    direntry *entries = (direntry *)dirblkbuf.data;
-    std::queue<struct direntry> res;
+static uint32_t bitrev(uint32_t h) {
+    uint32_t r = 0;
+    for (int i = 0; i < 32; i++, h >>= 1)
+        r = r << 1 | (h & 1);
+    return r;
+}
 
-    for (size_t n = 0; (n * BLKSIZE) < this->getsize(); n++) {
-        this->get_blk(n, &dirblkbuf);
-        for (int i = 0; i < DIRENTRY_PER_BLK; i++)
-            if (entries[i].ino == 0)
-                continue;
-            else
-                res.push(entries[i]);
+/* 名字哈希按位反转，bucket 按 index slot 的顺序各占一段连续的 key */
+static uint64_t dirkey(const char *name) { return bitrev(namehash(name)); }
+
+/* 按 key 排序后编上 position，同一 key 的 entry 按名字排出序号 */
+static void number(std::vector<dirslot_t> &slots) {
+    const size_t rmask = (1u << DIR_COOKIE_RANK_BITS) - 1;
+    for (auto &s : slots)
+        s.pos = dirkey(s.entry.name) << DIR_COOKIE_RANK_BITS;
+    std::sort(slots.begin(), slots.end(),
+              [](const dirslot_t &a, const dirslot_t &b) {
+                  if (a.pos != b.pos)
+                      return a.pos < b.pos;
+                  return namecmp(a.entry.name, b.entry.name) < 0;
+              });
+    for (size_t i = 1; i < slots.size(); i++)
+        if (slots[i].pos == (slots[i - 1].pos & ~rmask))
+            slots[i].pos |= MIN((slots[i - 1].pos & rmask) + 1, rmask);
+}
+
+int dir_t::read(size_t &pos, std::vector<dirslot_t> &out) {
+    blkbuf_t idx;
+    if (this->hashed(idx))
+        return this->hread(idx, pos, out);
+
+    // 线性目录的 position 与 entry 所在的 block 无关，一次读完再排序
+    std::vector<blkbuf_t> bufs(DIR_SCAN_BLKS);
+    std::vector<dirslot_t> slots;
+    size_t nblks = this->getsize() / BLKSIZE;
+    for (size_t n = 0; n < nblks; n += DIR_SCAN_BLKS) {
+        size_t k = MIN(DIR_SCAN_BLKS, nblks - n);
+        if (this->get_blks(n, k, bufs.data()) != 0)
+            return -1;
+        for (size_t b = 0; b < k; b++) {
+            direntry *entries = (direntry *)bufs[b].data;
+            for (int i = 0; i < DIRENTRY_PER_BLK; i++)
+                if (entries[i].ino != 0)
+                    slots.push_back({0, entries[i]});
+        }
     }
-    // returns the queue
-    return res;
+    number(slots);
+    for (auto &s : slots)
+        if (s.pos >= pos)
+            out.push_back(s);
+    pos = MAX(pos, (size_t)1 << (32 + DIR_COOKIE_RANK_BITS));
+    return 0;
 }
 
 int dir_t::add(uint32_t ino, const char *name) {
+    blkbuf_t idx;
+    if (this->hashed(idx)) {
+        // 旧格式的索引先重建
+        if (((dir_index *)idx.data)->magic == DIR_INDEX_MAGIC_V1 &&
+            (this->convert() != 0 || !this->hashed(idx)))
+            return -1;
+        if (this->hadd(idx, ino, name) != 0) {
+            Runtime::dcache.drop(this->ino, name);
+            return -1;
+        }
+        Runtime::dcache.set(this->ino, name, ino);
+        return 0;
+    }
+
+    // 一次扫描同时找同名 entry 和空位
+    // 名字已知不存在时不必查重，从 dirhint 开始找空位即可
+    uint32_t cached;
+    bool absent =
+        Runtime::dcache.lookup(this->ino, name, cached) && cached == 0;
+    std::vector<blkbuf_t> bufs(DIR_SCAN_BLKS);
+    size_t nblks = this->getsize() / BLKSIZE;
+    size_t hint = MIN(this->ic->dirhint, nblks);
     blkbuf_t dirblkbuf;
     direntry *entries = (direntry *)dirblkbuf.data;
     direntry *entry = nullptr;
+    bool dup = false;
 
-    // Make sure that name is not present.
-    while (this->lookup(name) != 0) {
-        this->remove(name);
+    for (size_t n = absent ? hint : 0; !dup && !(absent && entry) && n < nblks;
+         n += DIR_SCAN_BLKS) {
+        size_t k = MIN(DIR_SCAN_BLKS, nblks - n);
+        if (this->get_blks(n, k, bufs.data(), true) != 0)
+            return -1;
+        for (size_t b = 0; !dup && b < k; b++) {
+            direntry *scan = (direntry *)bufs[b].data;
+            for (int i = 0; !dup && i < DIRENTRY_PER_BLK; i++)
+                if (scan[i].ino == 0) {
+                    if (!entry && n + b >= hint) {
+                        dirblkbuf = bufs[b];
+                        entry = &entries[i];
+                        this->ic->dirhint = n + b;
+                    }
+                } else if (!absent && namecmp(name, scan[i].name) == 0) {
+                    // 同名 entry 直接覆盖
+                    dirblkbuf = bufs[b];
+                    entry = &entries[i];
+                    dup = true;
+                }
+        }
     }
 
-    // Look for an existing empty direntry
-    size_t n;
-    for (n = 0; !entry && (n * BLKSIZE) < this->getsize(); n++) {
-        this->get_blk(n, &dirblkbuf);
-        for (int i = 0; !entry && i < DIRENTRY_PER_BLK; i++)
-            if (entries[i].ino == 0) {
-                entry = &entries[i];
-            }
+    // A full directory is hashed from now on
+    if (!entry && nblks > 0) {
+        if (this->convert() != 0 || !this->hashed(idx))
+            return -1;
+        return this->add(ino, name);
     }
 
-    // If all existing entries are occupied, extend dir size by BLKSIZE
+    // An empty directory gets its first block
     if (!entry) {
-        this->inode.size += BLKSIZE;
-        this->dirty = 1;
-        this->get_blk(n, &dirblkbuf);
-        if (dirblkbuf.blkno == 0)
+        this->ic->inode.setsize(this->getsize() + BLKSIZE);
+        this->ic->dirty = 1;
+        if (this->get_blk(nblks, &dirblkbuf, true) != 0 ||
+            dirblkbuf.blkno == 0) {
+            this->ic->inode.setsize(this->getsize() - BLKSIZE);
             return -1;
+        }
         entry = &entries[0];
+        this->ic->dirhint = nblks;
     }
 
     // Fill entry, and persist dirblk
     strncpy(entry->name, name, MAX_FILENAME);
     entry->ino = ino;
-    dirblkbuf.persist();
+    if (dirblkbuf.persist() != 0) {
+        Runtime::dcache.drop(this->ino, name);
+        return -1;
+    }
+    Runtime::dcache.set(this->ino, name, ino);
 
     // On success, returns 0
     return 0;
@@ -86,24 +220,42 @@ int dir_t::add(uint32_t ino, const char *name) {
 
 // On remove, this will not call inode->deref()
 int dir_t::remove(const char *name) {
-    blkbuf_t dirblkbuf;
-    direntry *entries = (direntry *)dirblkbuf.data;
+    blkbuf_t idx;
+    if (this->hashed(idx)) {
+        if (((dir_index *)idx.data)->magic == DIR_INDEX_MAGIC_V1 &&
+            (this->convert() != 0 || !this->hashed(idx)))
+            return -1;
+        if (this->hremove(idx, name) != 0)
+            return -1;
+        Runtime::dcache.set(this->ino, name, 0);
+        return 0;
+    }
+
+    std::vector<blkbuf_t> bufs(DIR_SCAN_BLKS);
+    size_t nblks = this->getsize() / BLKSIZE;
 
     // DIR 所占的 size 总是 BLKSIZE 的整数倍
-    // 每次读入一个 BLK 并在其中查找
-    // 找到则返回其 ino
-    for (size_t n = 0; (n * BLKSIZE) < this->getsize(); n++) {
-        this->get_blk(n, &dirblkbuf);
-        for (int i = 0; i < DIRENTRY_PER_BLK; i++)
-            if (entries[i].ino == 0)
-                continue;
-            else if (namecmp(name, entries[i].name) == 0) {
-                // entry matches name
-                entries[i].ino = 0;
-                memset(entries[i].name, 0, MAX_FILENAME);
-                dirblkbuf.persist();
-                return 0;
-            }
+    // 每次读入 DIR_SCAN_BLKS 个 BLK 并在其中查找
+    // 找到则清除该 entry
+    for (size_t n = 0; n < nblks; n += DIR_SCAN_BLKS) {
+        size_t k = MIN(DIR_SCAN_BLKS, nblks - n);
+        if (this->get_blks(n, k, bufs.data(), true) != 0)
+            return -1;
+        for (size_t b = 0; b < k; b++) {
+            direntry *entries = (direntry *)bufs[b].data;
+            for (int i = 0; i < DIRENTRY_PER_BLK; i++)
+                if (entries[i].ino == 0)
+                    continue;
+                else if (namecmp(name, entries[i].name) == 0) {
+                    // entry matches name
+                    entries[i].ino = 0;
+                    memset(entries[i].name, 0, MAX_FILENAME);
+                    bufs[b].persist();
+                    Runtime::dcache.set(this->ino, name, 0);
+                    this->ic->dirhint = MIN(this->ic->dirhint, n + b);
+                    return 0;
+                }
+        }
     }
 
     // Not found, returns -1.
@@ -111,23 +263,364 @@ int dir_t::remove(const char *name) {
 }
 
 bool dir_t::hasChild() {
-    blkbuf_t dirblkbuf;
-    direntry *entries = (direntry *)dirblkbuf.data;
+    std::vector<blkbuf_t> bufs(DIR_SCAN_BLKS);
+    size_t nblks = this->getsize() / BLKSIZE;
     bool hasChild = false;
 
-    for (size_t n = 0; !hasChild && (n * BLKSIZE) < this->getsize(); n++) {
-        this->get_blk(n, &dirblkbuf);
-        for (int i = 0; i < DIRENTRY_PER_BLK; i++)
-            if (entries[i].ino == 0)
+    blkbuf_t idx;
+    bool hashed = this->hashed(idx);
+    size_t first = hashed ? 1 : 0;
+    for (size_t n = first; !hasChild && n < nblks; n += DIR_SCAN_BLKS) {
+        size_t k = MIN(DIR_SCAN_BLKS, nblks - n);
+        if (this->get_blks(n, k, bufs.data()) != 0)
+            break;
+        for (size_t b = 0; !hasChild && b < k; b++) {
+            if (hashed && isindex(idx, n + b))
                 continue;
-            else if (namecmp(".", entries[i].name) != 0 &&
-                     namecmp("..", entries[i].name) != 0) {
-                hasChild = true;
+            direntry *entries = (direntry *)bufs[b].data;
+            for (int i = 0; i < DIRENTRY_PER_BLK; i++)
+                if (entries[i].ino == 0)
+                    continue;
+                else if (namecmp(".", entries[i].name) != 0 &&
+                         namecmp("..", entries[i].name) != 0) {
+                    hasChild = true;
+                    break;
+                }
+        }
+    }
+
+    return hasChild;
+}
+
+/*
+ * 哈希目录：只需读索引 (索引页) 和名字所在的一个 bucket
+ * hlookup 在读取失败时返回 -1
+ */
+uint32_t dir_t::hlookup(blkbuf_t &idx, const char *name) {
+    dir_index *index = (dir_index *)idx.data;
+    uint32_t hash = namehash(name), blk;
+    if (index->magic == DIR_INDEX_MAGIC_V1) {
+        dir_index_v1 *v1 = (dir_index_v1 *)idx.data;
+        blk = v1->bucket[hash & ((1u << v1->depth) - 1)];
+    } else {
+        uint32_t v;
+        if (this->slot_get(idx, hash & ((1u << index->depth) - 1), v) != 0)
+            return -1;
+        blk = dir_slot_blk(v);
+        if (blk == 0)
+            return 0;
+    }
+    blkbuf_t bucket;
+    if (this->get_blk(blk, &bucket) != 0)
+        return -1;
+
+    direntry *entries = (direntry *)bucket.data;
+    for (int i = 0; i < DIRENTRY_PER_BLK; i++)
+        if (entries[i].ino != 0 && namecmp(name, entries[i].name) == 0)
+            return entries[i].ino;
+    return 0;
+}
+
+/*
+ * 从 pos 所在的 bucket 起，每次读一个 bucket，交出其中 position 不小于 pos
+ * 的 entry，再把 pos 移到这个 bucket 所占的一段 key 之后
+ * 旧格式的 bucket 可能被几个 slot 共用，只取属于当前 slot 的 entry
+ */
+int dir_t::hread(blkbuf_t &idx, size_t &pos, std::vector<dirslot_t> &out) {
+    dir_index *index = (dir_index *)idx.data;
+    dir_index_v1 *v1 = (dir_index_v1 *)idx.data;
+    bool old = index->magic == DIR_INDEX_MAGIC_V1;
+    uint32_t depth = old ? v1->depth : index->depth;
+    const uint64_t end = 1ull << 32;
+    std::vector<dirslot_t> slots;
+
+    for (size_t n = 0; n < DIR_SCAN_BLKS; n++) {
+        uint64_t key = pos >> DIR_COOKIE_RANK_BITS;
+        if (key >= end)
+            return 0;
+        uint32_t slot = bitrev(key) & ((1u << depth) - 1), blk, ld = depth;
+        if (old) {
+            blk = v1->bucket[slot];
+        } else {
+            uint32_t v;
+            if (this->slot_get(idx, slot, v) != 0)
+                return -1;
+            blk = dir_slot_blk(v);
+            ld = dir_slot_depth(v);
+        }
+        // 局部深度为 ld 的 bucket 包含 key 的高 ld 位相同的 entry
+        uint64_t span = end >> ld, lo = key & ~(span - 1);
+
+        if (blk != 0) {
+            blkbuf_t bucket;
+            if (this->get_blk(blk, &bucket) != 0)
+                return -1;
+            direntry *entries = (direntry *)bucket.data;
+            slots.clear();
+            for (int i = 0; i < DIRENTRY_PER_BLK; i++)
+                if (entries[i].ino != 0 &&
+                    (dirkey(entries[i].name) & ~(span - 1)) == lo)
+                    slots.push_back({0, entries[i]});
+            number(slots);
+            for (auto &s : slots)
+                if (s.pos >= pos)
+                    out.push_back(s);
+        }
+        pos = (lo + span) << DIR_COOKIE_RANK_BITS;
+    }
+    return (pos >> DIR_COOKIE_RANK_BITS) < end ? 1 : 0;
+}
+
+int dir_t::hadd(blkbuf_t &idx, uint32_t ino, const char *name) {
+    dir_index *index = (dir_index *)idx.data;
+    uint32_t hash = namehash(name);
+    blkbuf_t bucket;
+    direntry *entries = (direntry *)bucket.data;
+
+    for (;;) {
+        uint32_t slot = hash & ((1u << index->depth) - 1), v;
+        if (this->slot_get(idx, slot, v) != 0)
+            return -1;
+
+        // 空的 bucket 此时才分配 block
+        if (dir_slot_blk(v) == 0) {
+            uint32_t ld = dir_slot_depth(v), n;
+            if (this->newblk(bucket, n) != 0)
+                return -1;
+            strncpy(entries[0].name, name, MAX_FILENAME);
+            entries[0].ino = ino;
+            if (bucket.persist() != 0)
+                return -1;
+            return this->slot_set(idx, slot & ((1u << ld) - 1), 1u << ld,
+                                  dir_slot(n, ld));
+        }
+        if (this->get_blk(dir_slot_blk(v), &bucket, true) != 0)
+            return -1;
+
+        // 同名的 entry 直接覆盖，否则用第一个空位
+        direntry *entry = nullptr;
+        for (int i = 0; i < DIRENTRY_PER_BLK; i++)
+            if (entries[i].ino == 0) {
+                if (!entry)
+                    entry = &entries[i];
+            } else if (namecmp(name, entries[i].name) == 0) {
+                entry = &entries[i];
                 break;
             }
+
+        if (entry) {
+            strncpy(entry->name, name, MAX_FILENAME);
+            entry->ino = ino;
+            return bucket.persist();
+        }
+
+        // bucket 已满，分裂后重试
+        if (this->split(idx, slot) != 0)
+            return -1;
     }
+}
 
-    return hasChild;
+int dir_t::hremove(blkbuf_t &idx, const char *name) {
+    dir_index *index = (dir_index *)idx.data;
+    uint32_t slot = namehash(name) & ((1u << index->depth) - 1), v;
+    if (this->slot_get(idx, slot, v) != 0 || dir_slot_blk(v) == 0)
+        return -1;
+    blkbuf_t bucket;
+    if (this->get_blk(dir_slot_blk(v), &bucket, true) != 0)
+        return -1;
+
+    direntry *entries = (direntry *)bucket.data;
+    for (int i = 0; i < DIRENTRY_PER_BLK; i++)
+        if (entries[i].ino != 0 && namecmp(name, entries[i].name) == 0) {
+            entries[i].ino = 0;
+            memset(entries[i].name, 0, MAX_FILENAME);
+            return bucket.persist();
+        }
+    return -1;
+}
+
+int dir_t::slot_get(blkbuf_t &idx, uint32_t s, uint32_t &v) {
+    dir_index *index = (dir_index *)idx.data;
+    if (index->npages == 0) {
+        v = index->slot[s];
+        return 0;
+    }
+    blkbuf_t page;
+    if (this->get_blk(index->page[s / DIR_INDEX_PAGE_SLOTS], &page) != 0)
+        return -1;
+    v = ((uint32_t *)page.data)[s % DIR_INDEX_PAGE_SLOTS];
+    return 0;
+}
+
+int dir_t::slot_set(blkbuf_t &idx, uint32_t first, uint32_t step,
+                    uint32_t v) {
+    dir_index *index = (dir_index *)idx.data;
+    uint32_t nslots = 1u << index->depth;
+    if (index->npages == 0) {
+        for (uint32_t s = first; s < nslots; s += step)
+            index->slot[s] = v;
+        return idx.persist();
+    }
+
+    // 逐页修改，每页只读写一次
+    blkbuf_t page;
+    uint32_t p = UINT32_MAX;
+    for (uint32_t s = first; s < nslots; s += step) {
+        if (s / DIR_INDEX_PAGE_SLOTS != p) {
+            if (p != UINT32_MAX && page.persist() != 0)
+                return -1;
+            p = s / DIR_INDEX_PAGE_SLOTS;
+            if (this->get_blk(index->page[p], &page, true) != 0)
+                return -1;
+        }
+        ((uint32_t *)page.data)[s % DIR_INDEX_PAGE_SLOTS] = v;
+    }
+    return p == UINT32_MAX ? 0 : page.persist();
+}
+
+int dir_t::grow(blkbuf_t &idx) {
+    dir_index *index = (dir_index *)idx.data;
+    uint32_t nslots = 1u << index->depth;
+    if (index->depth == DIR_INDEX_MAX_DEPTH)
+        return -1;
+    if (index->depth < DIR_INDEX_INLINE_DEPTH) {
+        memcpy(&index->slot[nslots], index->slot, nslots * sizeof(uint32_t));
+        index->depth++;
+        return idx.persist();
+    }
+
+    // 后一半 slot 复制前一半：block 0 中的 slot 移到第一个索引页，
+    // 之后每次翻倍时新增同样多的索引页
+    blkbuf_t page, from;
+    uint32_t n;
+    if (index->npages == 0) {
+        if (this->newblk(page, n) != 0)
+            return -1;
+        memcpy(page.data, index->slot, nslots * sizeof(uint32_t));
+        memcpy(page.data + nslots * sizeof(uint32_t), index->slot,
+               nslots * sizeof(uint32_t));
+        if (page.persist() != 0)
+            return -1;
+        memset(index->slot, 0, sizeof(index->slot));
+        index->page[index->npages++] = n;
+    } else {
+        uint32_t npages = index->npages;
+        for (uint32_t p = 0; p < npages; p++) {
+            if (this->get_blk(index->page[p], &from) != 0 ||
+                this->newblk(page, n) != 0)
+                return -1;
+            memcpy(page.data, from.data, BLKSIZE);
+            if (page.persist() != 0)
+                return -1;
+            index->page[index->npages++] = n;
+        }
+    }
+    index->depth++;
+    return idx.persist();
+}
+
+int dir_t::newblk(blkbuf_t &buf, uint32_t &n) {
+    n = this->getsize() / BLKSIZE;
+    if (n >= DIR_MAX_BLKS)
+        return -1;
+    this->ic->inode.setsize(this->getsize() + BLKSIZE);
+    this->ic->dirty = true;
+    if (this->get_blk(n, &buf, true) != 0 || buf.blkno == 0) {
+        this->ic->inode.setsize(this->getsize() - BLKSIZE);
+        return -1;
+    }
+    memset(buf.data, 0, BLKSIZE);
+    return 0;
+}
+
+/*
+ * 按哈希的第 local depth 位把 bucket 分成两个
+ * entry 全部落在一边时不分配新 block，另一边的 slot 记为空 bucket
+ */
+int dir_t::split(blkbuf_t &idx, uint32_t slot) {
+    dir_index *index = (dir_index *)idx.data;
+    uint32_t v;
+    if (this->slot_get(idx, slot, v) != 0)
+        return -1;
+    uint32_t ld = dir_slot_depth(v), old = dir_slot_blk(v);
+    // 局部 depth 已等于全局 depth，索引需要翻倍
+    if (ld == index->depth && this->grow(idx) != 0)
+        return -1;
+    uint32_t bit = 1u << ld;
+
+    blkbuf_t oldbuf;
+    if (this->get_blk(old, &oldbuf, true) != 0)
+        return -1;
+    direntry *from = (direntry *)oldbuf.data;
+    int nhigh = 0, nlow = 0;
+    for (int i = 0; i < DIRENTRY_PER_BLK; i++)
+        if (from[i].ino != 0)
+            (namehash(from[i].name) & bit ? nhigh : nlow)++;
+
+    uint32_t low, high;
+    if (nhigh && nlow) {
+        blkbuf_t newbuf;
+        uint32_t n;
+        if (this->newblk(newbuf, n) != 0)
+            return -1;
+        direntry *to = (direntry *)newbuf.data;
+        int k = 0;
+        for (int i = 0; i < DIRENTRY_PER_BLK; i++)
+            if (from[i].ino != 0 && (namehash(from[i].name) & bit)) {
+                to[k++] = from[i];
+                memset(&from[i], 0, sizeof(direntry));
+            }
+        if (newbuf.persist() != 0 || oldbuf.persist() != 0)
+            return -1;
+        low = dir_slot(old, ld + 1);
+        high = dir_slot(n, ld + 1);
+    } else {
+        low = dir_slot(nlow ? old : 0, ld + 1);
+        high = dir_slot(nhigh ? old : 0, ld + 1);
+    }
+    uint32_t first = slot & (bit - 1);
+    if (this->slot_set(idx, first, bit << 1, low) != 0 ||
+        this->slot_set(idx, first | bit, bit << 1, high) != 0)
+        return -1;
+    return 0;
+}
+
+int dir_t::convert() {
+    std::vector<dirslot_t> entries;
+    size_t pos = 0;
+    int more;
+    while ((more = this->read(pos, entries)) == 1)
+        ;
+    if (more < 0)
+        return -1;
+
+    // 原有的 block 先换到一个 scratch inode 上，索引和 bucket 建在新 block 中；
+    // 全部 entry 加入之后才释放原有的 block，中途失败则换回原样
+    inode_t old = this->scratch();
+    this->swap_map(old);
+    this->ic->dirhint = 0;
+    this->ic->inode.setsize(2 * BLKSIZE);
+    blkbuf_t idx, bucket;
+    bool ok = this->get_blk(0, &idx, true) == 0 && idx.blkno != 0 &&
+              this->get_blk(1, &bucket, true) == 0 && bucket.blkno != 0;
+    if (ok) {
+        memset(idx.data, 0, BLKSIZE);
+        dir_index *index = (dir_index *)idx.data;
+        index->magic = DIR_INDEX_MAGIC;
+        index->depth = 0;
+        index->slot[0] = dir_slot(1, 0);
+        memset(bucket.data, 0, BLKSIZE);
+        ok = bucket.persist() == 0 && idx.persist() == 0;
+    }
+    for (size_t i = 0; ok && i < entries.size(); i++)
+        ok = this->hadd(idx, entries[i].entry.ino, entries[i].entry.name) == 0;
+
+    if (!ok) {
+        this->shrinkto(0);
+        this->swap_map(old);
+        return -1;
+    }
+    return old.shrinkto(0);
 }
 
 } // namespace aqfs
@@ -1,17 +1,139 @@
 #include "disk.h"
 #include "runtime.h"
+#include "stats.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
 
 namespace aqfs {
 
-/* 需要 root 已经被设置 */
+int disk_t::open(std::string root, bool mmap) {
+    struct stat st;
+    if (stat(root.c_str(), &st) != 0)
+        return -1;
+    this->close();
+    this->root = root;
+
+    /* a directory means one file per block, anything else is an image */
+    if (S_ISDIR(st.st_mode))
+        return 0;
+
+    this->fd = ::open(root.c_str(), O_RDWR);
+    if (this->fd < 0)
+        return -1;
+    if (!mmap) {
+        this->ring.init(DISK_URING_DEPTH);
+        return 0;
+    }
+
+    /* map the whole volume, st_size is 0 for block devices */
+    off_t size = lseek(this->fd, 0, SEEK_END);
+    if (size < BLKSIZE) {
+        this->close();
+        return -1;
+    }
+    void *addr =
+        ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+    if (addr == MAP_FAILED) {
+        this->close();
+        return -1;
+    }
+    this->map = (char *)addr;
+    this->mapsize = size;
+    return 0;
+}
+
+void disk_t::close() {
+    this->ring.fini();
+    if (this->map) {
+        msync(this->map, this->mapsize, MS_SYNC);
+        munmap(this->map, this->mapsize);
+    }
+    this->map = nullptr;
+    this->mapsize = 0;
+    if (this->fd >= 0)
+        ::close(this->fd);
+    this->fd = -1;
+}
+
+char *disk_t::blkaddr(uint32_t blkno) {
+    if (!this->map || ((size_t)blkno + 1) * BLKSIZE > this->mapsize)
+        return nullptr;
+    return this->map + (size_t)blkno * BLKSIZE;
+}
+
+int disk_t::sync() {
+#ifdef AQFS_STATS
+    io_timer_t t(IO_SYNC);
+#endif
+    if (this->map)
+        return msync(this->map, this->mapsize, MS_SYNC);
+    if (this->fd >= 0)
+        return fsync(this->fd);
+    return 0;
+}
+
+void disk_t::advise(const uint32_t *blknos, size_t n) {
+    /* the per-block files are read whole anyway */
+    if (this->fd < 0)
+        return;
+    for (size_t i = 0, j; i < n; i = j) {
+        for (j = i + 1; j < n && blknos[j] == blknos[j - 1] + 1; j++)
+            ;
+        off_t off = (off_t)blknos[i] * BLKSIZE;
+        size_t len = (j - i) * BLKSIZE;
+        if (this->map) {
+            if ((size_t)off + len <= this->mapsize)
+                madvise(this->map + off, len, MADV_WILLNEED);
+        } else
+            posix_fadvise(this->fd, off, len, POSIX_FADV_WILLNEED);
+    }
+}
+
+/* 需要 disk 已经被 open */
 int disk_t::read(uint32_t blkno, char *buf) {
-    char fname[10];
-    sprintf(fname, "/blk_%04d", blkno);
+#ifdef AQFS_STATS
+    blkio_t io = {blkno, buf};
+    io_timer_t t(IO_READ, &io, 1);
+#endif
+    if (this->map) {
+        char *addr = this->blkaddr(blkno);
+        if (addr == nullptr)
+            return -1;
+        memcpy(buf, addr, BLKSIZE);
+        return 0;
+    }
+    if (this->fd >= 0) {
+        off_t off = (off_t)blkno * BLKSIZE;
+        for (size_t done = 0; done < BLKSIZE;) {
+            ssize_t n = pread(this->fd, buf + done, BLKSIZE - done, off + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return -1;
+            done += n;
+        }
+        return 0;
+    }
+
+    char fname[16];
+    snprintf(fname, sizeof(fname), "/blk_%04d", blkno);
     std::string path = this->root + fname;
+    errno = 0;
     std::ifstream f(path);
 
+    /* a block never written has no file yet, and reads as zeros */
+    if (!f.is_open() && errno == ENOENT) {
+        memset(buf, 0, BLKSIZE);
+        return 0;
+    }
     if (f.read(buf, BLKSIZE))
         return 0;
     else
@@ -19,8 +141,33 @@ int disk_t::read(uint32_t blkno, char *buf) {
 }
 
 int disk_t::write(uint32_t blkno, char *buf) {
-    char fname[10];
-    sprintf(fname, "/blk_%04d", blkno);
+#ifdef AQFS_STATS
+    blkio_t io = {blkno, buf};
+    io_timer_t t(IO_WRITE, &io, 1);
+#endif
+    if (this->map) {
+        char *addr = this->blkaddr(blkno);
+        if (addr == nullptr)
+            return -1;
+        memcpy(addr, buf, BLKSIZE);
+        return 0;
+    }
+    if (this->fd >= 0) {
+        off_t off = (off_t)blkno * BLKSIZE;
+        for (size_t done = 0; done < BLKSIZE;) {
+            ssize_t n =
+                pwrite(this->fd, buf + done, BLKSIZE - done, off + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return -1;
+            done += n;
+        }
+        return 0;
+    }
+
+    char fname[16];
+    snprintf(fname, sizeof(fname), "/blk_%04d", blkno);
     std::string path = this->root + fname;
     std::ofstream f(path);
 
@@ -30,4 +177,64 @@ int disk_t::write(uint32_t blkno, char *buf) {
         return -1;
 }
 
+int disk_t::rw(bool write, const blkio_t *ios, size_t n) {
+#ifdef AQFS_STATS
+    io_timer_t t(write ? IO_WRITE : IO_READ, ios, n);
+#endif
+    /* no ring, one block at a time */
+    std::unique_lock<std::mutex> l(this->ringlock);
+    if (!this->ring.ok()) {
+        l.unlock();
+        for (size_t i = 0; i < n; i++) {
+            int res = write ? this->write(ios[i].blkno, ios[i].buf)
+                            : this->read(ios[i].blkno, ios[i].buf);
+            if (res != 0)
+                return -1;
+        }
+        return 0;
+    }
+
+    std::vector<struct iovec> iov(n);
+    uint64_t done[DISK_URING_DEPTH];
+    int res[DISK_URING_DEPTH];
+    for (size_t i = 0; i < n;) {
+        /* fill the ring, merging runs of consecutive blocks */
+        size_t start = i;
+        unsigned queued = 0;
+        while (i < n && queued < this->ring.depth()) {
+            size_t j = i;
+            do {
+                iov[j].iov_base = ios[j].buf;
+                iov[j].iov_len = BLKSIZE;
+                j++;
+            } while (j < n && j - i < IOV_MAX &&
+                     ios[j].blkno == ios[j - 1].blkno + 1);
+            off_t off = (off_t)ios[i].blkno * BLKSIZE;
+            if (this->ring.prep(write, this->fd, &iov[i], j - i, off,
+                                (j - i) * BLKSIZE) != 0)
+                break;
+            queued++;
+            i = j;
+        }
+
+        int nr = this->ring.submit_and_wait(done, res, DISK_URING_DEPTH);
+        bool ok = nr == (int)queued;
+        for (int k = 0; ok && k < nr; k++)
+            ok = res[k] >= 0 && (uint64_t)res[k] == done[k];
+        if (ok)
+            continue;
+
+        /* the kernel refused (or cut short) part of it, redo synchronously */
+        if (nr < 0 || (nr > 0 && res[0] == -EINVAL))
+            this->ring.fini();
+        for (size_t k = start; k < i; k++) {
+            int r = write ? this->write(ios[k].blkno, ios[k].buf)
+                          : this->read(ios[k].blkno, ios[k].buf);
+            if (r != 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
 } // namespace aqfs
@@ -1,32 +1,133 @@
 #include "fs.h"
 #include "dir.h"
+#include "file.h"
+#include "journal.h"
 #include "runtime.h"
+#include <algorithm>
 #include <boost/filesystem.hpp>
+#include <cstdio>
 #include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
 #include <vector>
 
-static char blk_root[] = "/home/vagrant/fs";
+static std::string blk_root = "/home/vagrant/fs";
+static bool blk_mmap = false;
+static size_t blk_nbufs = aqfs::BCACHE_NBUFS;
+/* the volume is open: from main, before mounting, until destroy */
+static bool blk_open = false;
+static bool new_extents = false; /* map new inodes with extents */
+static const char *trace_path = nullptr; /* block I/O trace, see stats.h */
 typedef boost::filesystem::path path_t;
 using aqfs::dir_t;
+using aqfs::dirslot_t;
+using aqfs::file_t;
 using aqfs::inode_t;
+using aqfs::txn_t;
+typedef std::unique_lock<inode_t> wlock_t;
+typedef std::shared_lock<inode_t> rlock_t;
+
+/*
+ * locking: every operation runs under the locks of the inodes it touches
+ *  - a path walk holds one directory at a time, for reading
+ *  - an operation then holds at most a directory and one of its entries'
+ *    inodes, the directory first
+ *  - rename holds two directories: renames are serialized on rename_lock,
+ *    under which the tree keeps its shape, and an ancestor is locked before
+ *    its descendant, unrelated directories in ino order (as Linux does)
+ * the caches and the allocator below have their own locks, which are never
+ * held while waiting for an inode
+ * an operation that changes the volume is a transaction (txn_t), begun
+ * before its first lock and ended after its last, and so outside them all
+ */
+static std::mutex rename_lock;
+
+/* the lookup in one directory of a path walk */
+static uint32_t lookup(dir_t &d, const char *name) {
+    rlock_t l(d);
+    return d.lookup(name);
+}
+
+/* an inode removed while we were walking to it */
+static bool dead(inode_t &inode) { return inode.getrefcount() == 0; }
+
+/* open inode `ino` into `fi` */
+static int open_ino(uint32_t ino, struct fuse_file_info *fi) {
+    file_t *f = new file_t(ino);
+    if (f->inode.bad()) {
+        delete f;
+        return -EIO;
+    }
+    wlock_t l(f->inode);
+    if (dead(f->inode)) {
+        l.unlock();
+        delete f;
+        return -ENOENT;
+    }
+    f->inode.open();
+    fi->fh = (uint64_t)f;
+    return 0;
+}
+
+static void close_ino(struct fuse_file_info *fi) {
+    file_t *f = (file_t *)fi->fh;
+    wlock_t l(f->inode);
+    f->inode.close();
+    l.unlock();
+    delete f;
+}
+
+/*
+ * the hidden, read-only file at the mount root that shows the statistics of
+ * stats.h as text; it has no entry in the root directory, so listings leave
+ * it out, and builds without AQFS_STATS do not have it
+ */
+static bool is_stats(const char *path) {
+#ifdef AQFS_STATS
+    return strcmp(path, "/.aqfs_stats") == 0;
+#else
+    return false;
+#endif
+}
+
+/* is `d` below directory `anc`? to be asked under rename_lock */
+static bool below(dir_t d, uint32_t anc) {
+    while (d.getino() != 1) {
+        uint32_t up = lookup(d, "..");
+        if (up == anc)
+            return true;
+        if (up == 0 || up == d.getino())
+            return false;
+        d = dir_t(up);
+    }
+    return false;
+}
 
 /* helpers */
 int cd(dir_t &d, path_t p) {
+    if (d.bad())
+        return -EIO;
     for (auto name : p) {
         /* 在目录查找对应 entry 的 inode number */
-        uint32_t ino = d.lookup(name.c_str());
+        uint32_t ino = lookup(d, name.c_str());
 
         /* 如果没有相应的 entry (lookup() 结果为 0)，返回 -ENOENT */
         if (ino == 0)
             return -ENOENT;
 
         /* 如果对应的 inode 不是一个 DIR，返回 -ENOTDIR */
-        inode_t i(ino);
-        if ((i.getmode() & S_IFDIR) != S_IFDIR)
+        dir_t next(ino);
+        if (next.bad())
+            return -EIO;
+        rlock_t l(next);
+        if ((next.getmode() & S_IFDIR) != S_IFDIR)
             return -ENOTDIR;
+        l.unlock();
 
         /* 将 d 改为下一级目录 */
-        d = dir_t(ino);
+        d = next;
     }
     return 0;
 }
@@ -52,7 +153,7 @@ int getino(path_t p, uint32_t &ino) {
         return res;
 
     /* 在其中查询该文件的 inode number */
-    ino = d.lookup(name.c_str());
+    ino = lookup(d, name.c_str());
     if (ino == 0)
         return -ENOENT;
 
@@ -62,12 +163,25 @@ int getino(path_t p, uint32_t &ino) {
 namespace aqfs {
 
 void *fs::init(struct fuse_conn_info *conn) {
-    Runtime::init(blk_root);
+    /* main has opened the volume already */
     return nullptr;
 }
-void fs::destroy(void *private_data) { Runtime::fini(); }
+void fs::destroy(void *private_data) {
+    Runtime::fini();
+    blk_open = false;
+#ifdef AQFS_STATS
+    iostat.trace_close();
+    fputs(stats.dump().c_str(), stderr);
+#endif
+}
 
 int fs::getattr(const char *path, struct stat *statbuf) {
+    if (is_stats(path)) {
+        statbuf->st_mode = S_IFREG | 0444;
+        statbuf->st_nlink = 1;
+        statbuf->st_size = stats.dump().size();
+        return 0;
+    }
 
     path_t p(path);
     path_t parent = p.parent_path();
@@ -80,6 +194,9 @@ int fs::getattr(const char *path, struct stat *statbuf) {
     /* 如果 `path` 是根目录，直接填充信息 */
     if (p == "/") {
         inode_t root_inode(1);
+        if (root_inode.bad())
+            return -EIO;
+        rlock_t l(root_inode);
         statbuf->st_ino = 1;
         statbuf->st_mode = root_inode.getmode();
         statbuf->st_nlink = root_inode.getrefcount();
@@ -93,12 +210,15 @@ int fs::getattr(const char *path, struct stat *statbuf) {
         return res;
 
     /* 在其中查询该文件的 inode number */
-    uint32_t ino = d.lookup(name.c_str());
+    uint32_t ino = lookup(d, name.c_str());
     if (ino == 0)
         return -ENOENT;
 
     /* 从相应的 inode 里读取元数据 */
     inode_t inode(ino);
+    if (inode.bad())
+        return -EIO;
+    rlock_t l(inode);
     statbuf->st_ino = ino;
     statbuf->st_mode = inode.getmode();
     statbuf->st_nlink = inode.getrefcount();
@@ -127,12 +247,15 @@ int fs::readlink(const char *path, char *buf, size_t size) {
         return res;
 
     /* 在其中查询该 symlink 的 inode number */
-    uint32_t ino = d.lookup(name.c_str());
+    uint32_t ino = lookup(d, name.c_str());
     if (ino == 0)
         return -ENOENT;
 
     /* 从相应的 inode 里读取 symlink 内容到 `buf` */
     inode_t inode(ino);
+    if (inode.bad())
+        return -EIO;
+    rlock_t l(inode);
     uint32_t slen = inode.getsize(); /* symlink length */
     if (size < slen)
         slen = size;
@@ -156,56 +279,52 @@ int fs::opendir(const char *path, struct fuse_file_info *fi) {
         return res;
 
     /**
-     * 设置 fi->fh 为 目录对应的 inode number.
-     * opendir() 会调用 addref()，releasedir() 中利用 fi->fh 来找到相应的 inode
-     * 并在其上调用 deref().
-     * [⚠️] 当 deref() 后，如果 refcount 为 0，inode 会自动销毁.
+     * fi->fh 指向一个 file_t，它持有目录的 inode，
+     * 直到 releasedir() 为止目录都不会被销毁.
      */
-    fi->fh = d.getino();
-    d.addref();
-
-    return 0;
+    return open_ino(d.getino(), fi);
 }
 
 int fs::readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off,
                 struct fuse_file_info *fi) {
-    path_t p(path);
+    /* opendir() 已经找到了目录 */
+    dir_t d(((file_t *)fi->fh)->inode.getino());
 
-    /* 验证根目录 */
-    if (p.root_directory() != "/")
-        return -ENOENT;
-
-    /* 找到目录 */
-    dir_t d(1);
-    int res = cd(d, p.relative_path());
-    if (res != 0)
-        return res;
+    /**
+     * 从 `off` 开始，一批一批地读出 entry 交给 filler，直到 buf 满为止.
+     * 每个 entry 的 offset 是它之后的位置，下次从那里继续.
+     */
+    size_t pos = off;
+    for (int more = 1; more == 1;) {
+        std::vector<dirslot_t> slots;
+        rlock_t l(d);
+        more = d.read(pos, slots);
+        l.unlock();
+        if (more < 0)
+            return -EIO;
 
-    /* 读出该目录所有的 entry */
-    auto entries = d.read();
-    while (!entries.empty()) {
-        /* 获取一个 entry 的 inode number */
-        uint32_t ino = entries.front().ino;
-
-        /* 读取这个 inode 的元数据 */
-        struct stat st = {0};
-        inode_t inode(ino);
-        st.st_ino = ino;
-        st.st_mode = inode.getmode();
-        st.st_nlink = inode.getrefcount();
-        if (st.st_nlink == S_IFREG)
-            st.st_size = inode.getsize();
-
-        /* 塞进buf，忽略`off` */
-        // entry.name 应当以 \0 结尾
-        filler(buf, entries.front().name, &st, 0);
-        entries.pop();
+        /* 只需要 st_ino 和 st_mode 的类型位，整批一起取 */
+        std::vector<uint32_t> inos(slots.size());
+        std::vector<mode_t> modes(slots.size());
+        for (size_t i = 0; i < slots.size(); i++)
+            inos[i] = slots[i].entry.ino;
+        Runtime::icache.modes(slots.size(), inos.data(), modes.data());
+
+        for (size_t i = 0; i < slots.size(); i++) {
+            struct stat st = {0};
+            st.st_ino = inos[i];
+            st.st_mode = modes[i];
+            // entry.name 应当以 \0 结尾
+            if (filler(buf, slots[i].entry.name, &st, slots[i].pos + 1) != 0)
+                return 0;
+        }
     }
 
     return 0;
 }
 
 int fs::mkdir(const char *path, mode_t mode) {
+    txn_t t;
     path_t p(path);
     path_t parent = p.parent_path();
     path_t name = p.filename();
@@ -223,34 +342,54 @@ int fs::mkdir(const char *path, mode_t mode) {
         return res;
 
     /* 如果 `path` 已存在，返回 -EEXIST */
+    wlock_t l(d);
+    if (dead(d))
+        return -ENOENT;
     if (name == "." || name == "..")
         return -EEXIST;
     else if (d.lookup(name.c_str()) != 0)
         return -EEXIST;
 
-    /* 找到一个未被使用的 inode */
-    uint32_t ino = Runtime::bitmap.imap.find_empty();
+    /* 分配一个未被使用的 inode */
+    uint32_t ino = Runtime::bitmap.alloc_ino();
+    if (ino == 0)
+        return -ENOSPC;
+
+    dir_t dir(ino);
+    if (dir.bad()) {
+        Runtime::bitmap.free_ino(ino);
+        return -EIO;
+    }
 
     /* 创建 direntry */
     res = d.add(ino, name.c_str());
-    if (res != 0)
+    if (res != 0) {
         /* link 已满 */
+        Runtime::bitmap.free_ino(ino);
         return -EMLINK;
+    }
 
     /* 创建 dir */
-    Runtime::bitmap.imap.set(ino);
-    dir_t dir(ino);
-    dir.zero();
+    wlock_t cl(dir);
+    dir.zero(new_extents);
     dir.setmode(S_IFDIR | 0755);
     dir.addref();
 
-    dir.add(ino, ".");
+    /* 没有空间存放目录的第一个 block 时撤销创建 */
+    if (dir.add(ino, ".") != 0) {
+        d.remove(name.c_str());
+        dir.deref();
+        return -ENOSPC;
+    }
     dir.add(d.getino(), "..");
 
     return 0;
 }
 
 int fs::unlink(const char *path) {
+    if (is_stats(path))
+        return -EACCES;
+    txn_t t;
     path_t p(path);
     path_t parent = p.parent_path();
     path_t name = p.filename();
@@ -266,12 +405,16 @@ int fs::unlink(const char *path) {
         return res;
 
     /* 在其中查询该文件的 inode number */
+    wlock_t l(d);
     uint32_t ino = d.lookup(name.c_str());
     if (ino == 0)
         return -ENOENT;
 
     /* deref() */
     inode_t inode(ino);
+    if (inode.bad())
+        return -EIO;
+    wlock_t il(inode);
     inode.deref();
 
     /* remove entry */
@@ -281,6 +424,7 @@ int fs::unlink(const char *path) {
 }
 
 int fs::rmdir(const char *path) {
+    txn_t t;
     path_t p(path);
     path_t parent = p.parent_path();
     path_t name = p.filename();
@@ -293,19 +437,29 @@ int fs::rmdir(const char *path) {
     if (name == "/" || name == "." || name == "..")
         return -EISDIR;
 
-    /* cd 到 `path` */
-    dir_t target(1);
-    int res = cd(target, p.relative_path());
+    /* 找到 `path` 的上级目录 */
+    dir_t parent_dir(1);
+    int res = cd(parent_dir, parent.relative_path());
     if (res != 0)
         return res;
 
+    /* 在其中找到该目录 */
+    wlock_t l(parent_dir);
+    uint32_t ino = parent_dir.lookup(name.c_str());
+    if (ino == 0)
+        return -ENOENT;
+    dir_t target(ino);
+    if (target.bad())
+        return -EIO;
+    wlock_t tl(target);
+    if ((target.getmode() & S_IFDIR) != S_IFDIR)
+        return -ENOTDIR;
+
     /* 检查 links */
     if (target.hasChild())
         return -ENOTEMPTY;
 
     /* remove the entry in its parent */
-    dir_t parent_dir(target.getino());
-    cd(parent_dir, "..");
     parent_dir.remove(name.c_str());
 
     /* deref that dir */
@@ -315,6 +469,7 @@ int fs::rmdir(const char *path) {
 }
 
 int fs::symlink(const char *to, const char *from) {
+    txn_t t;
     path_t p(from);
     path_t parent = p.parent_path();
     path_t name = p.filename();
@@ -330,22 +485,34 @@ int fs::symlink(const char *to, const char *from) {
         return res;
 
     /* 如果 `path` 已存在，返回 -EEXIST */
+    wlock_t l(d);
+    if (dead(d))
+        return -ENOENT;
     if (d.lookup(name.c_str()) != 0)
         return -EEXIST;
 
-    /* 找到一个未被使用的 inode */
-    uint32_t ino = Runtime::bitmap.imap.find_empty();
+    /* 分配一个未被使用的 inode */
+    uint32_t ino = Runtime::bitmap.alloc_ino();
+    if (ino == 0)
+        return -ENOSPC;
+
+    inode_t symlink(ino);
+    if (symlink.bad()) {
+        Runtime::bitmap.free_ino(ino);
+        return -EIO;
+    }
 
     /* 创建 direntry */
     res = d.add(ino, name.c_str());
-    if (res != 0)
+    if (res != 0) {
         /* link 已满 */
+        Runtime::bitmap.free_ino(ino);
         return -EMLINK;
+    }
 
     /* 创建 symlink 的 inode */
-    Runtime::bitmap.imap.set(ino);
-    inode_t symlink(ino);
-    symlink.zero();
+    wlock_t sl(symlink);
+    symlink.zero(new_extents);
     symlink.setmode(S_IFLNK | 0755);
     symlink.addref();
 
@@ -356,6 +523,9 @@ int fs::symlink(const char *to, const char *from) {
 }
 
 int fs::rename(const char *from, const char *to) {
+    if (is_stats(from) || is_stats(to))
+        return -EACCES;
+    txn_t t;
     path_t p(from);
     path_t parent = p.parent_path();
     path_t name = p.filename();
@@ -371,6 +541,7 @@ int fs::rename(const char *from, const char *to) {
         return -EISDIR;
 
     /* 找到 `from` 和 `to` 的上级目录 */
+    std::lock_guard<std::mutex> rl(rename_lock);
     dir_t d(1), to_d(1);
     int res = cd(d, parent.relative_path());
     if (res != 0)
@@ -379,11 +550,52 @@ int fs::rename(const char *from, const char *to) {
     if (res != 0)
         return res;
 
+    /* 按顺序锁住两个目录：祖先在前，否则 ino 小的在前 */
+    wlock_t l, to_l;
+    if (d.getino() == to_d.getino())
+        l = wlock_t(d);
+    else if (below(to_d, d.getino()) ||
+             (!below(d, to_d.getino()) && d.getino() < to_d.getino())) {
+        l = wlock_t(d);
+        to_l = wlock_t(to_d);
+    } else {
+        to_l = wlock_t(to_d);
+        l = wlock_t(d);
+    }
+    if (dead(d) || dead(to_d))
+        return -ENOENT;
+
     /* 找到相应的 inode */
     uint32_t ino = d.lookup(name.c_str());
     if (ino == 0)
         return -ENOENT;
-    inode_t inode(ino);
+    dir_t inode(ino);
+    if (inode.bad())
+        return -EIO;
+    wlock_t il(inode);
+    bool isdir = (inode.getmode() & S_IFDIR) == S_IFDIR;
+
+    /*
+     * 目标已存在时像 unlink / rmdir 一样释放它；
+     * 是同一个 inode 时什么都不做
+     */
+    uint32_t old = to_d.lookup(to_name.c_str());
+    if (old == ino)
+        return 0;
+    if (old != 0) {
+        dir_t victim(old);
+        if (victim.bad())
+            return -EIO;
+        wlock_t vl(victim);
+        bool victim_isdir = (victim.getmode() & S_IFDIR) == S_IFDIR;
+        if (victim_isdir != isdir)
+            return victim_isdir ? -EISDIR : -ENOTDIR;
+        if (victim_isdir && victim.hasChild())
+            return -ENOTEMPTY;
+        if (to_d.remove(to_name.c_str()) != 0)
+            return -EIO;
+        victim.deref();
+    }
 
     /* create and remove entry */
     res = to_d.add(ino, to_name.c_str());
@@ -391,10 +603,17 @@ int fs::rename(const char *from, const char *to) {
         return -EMLINK;
     d.remove(name.c_str());
 
+    /* 移到另一个目录下的目录，`..` 也要跟着改 */
+    if (isdir && d.getino() != to_d.getino()) {
+        inode.remove("..");
+        inode.add(to_d.getino(), "..");
+    }
+
     return 0;
 }
 
 int fs::link(const char *from, const char *to) {
+    txn_t t;
     path_t p(from);
     path_t parent = p.parent_path();
     path_t name = p.filename();
@@ -406,8 +625,10 @@ int fs::link(const char *from, const char *to) {
     /* 验证根目录 */
     if (p.root_directory() != "/" || to_p.root_directory() != "/")
         return -ENOENT;
-    if (p == "/" || to_p == "/")
-        return -EISDIR;
+    if (p == "/")
+        return -EPERM;
+    if (to_p == "/")
+        return -EEXIST;
 
     /* 找到 `from` 和 `to` 的上级目录 */
     dir_t d(1), to_d(1);
@@ -419,14 +640,27 @@ int fs::link(const char *from, const char *to) {
         return res;
 
     /* 找到相应的 inode */
-    uint32_t ino = d.lookup(name.c_str());
+    uint32_t ino = lookup(d, name.c_str());
     if (ino == 0)
         return -ENOENT;
+
+    /*
+     * 只需锁住新 entry 所在的目录和 inode 本身；
+     * 如果 inode 在此期间已被删除，不再为它建立 link
+     */
+    wlock_t l(to_d);
+    if (dead(to_d))
+        return -ENOENT;
     inode_t inode(ino);
+    if (inode.bad())
+        return -EIO;
+    wlock_t il(inode);
+    if (dead(inode))
+        return -ENOENT;
 
     /* 确认它不是一个目录 (POSIX.1) */
     if ((inode.getmode() & S_IFDIR) == S_IFDIR)
-        return -EISDIR;
+        return -EPERM;
 
     /* create link and add ref */
     res = to_d.add(ino, to_name.c_str());
@@ -438,6 +672,9 @@ int fs::link(const char *from, const char *to) {
 }
 
 int fs::chmod(const char *path, mode_t mode) {
+    if (is_stats(path))
+        return -EACCES;
+    txn_t t;
     path_t p(path);
 
     uint32_t ino;
@@ -446,33 +683,46 @@ int fs::chmod(const char *path, mode_t mode) {
         return res;
 
     inode_t inode(ino);
+    if (inode.bad())
+        return -EIO;
+    wlock_t l(inode);
+    if (dead(inode))
+        return -ENOENT;
     inode.setmode(mode);
 
     return 0;
 }
 
 int fs::truncate(const char *path, off_t size) {
+    if (is_stats(path))
+        return -EACCES;
+    txn_t t;
     path_t p(path);
     uint32_t ino;
 
     if (size < 0)
         return -EINVAL;
+    if (size > (off_t)MAX_FILE_SIZE)
+        return -EFBIG;
 
     /* get that inode */
     int res = getino(p, ino);
     if (res != 0)
         return res;
     inode_t inode(ino);
+    if (inode.bad())
+        return -EIO;
+    wlock_t l(inode);
+    if (dead(inode))
+        return -ENOENT;
 
-    /* 根据 size 关系来 write 或 shrink */
-    uint32_t curr_size = inode.getsize();
+    /* 根据 size 关系来 extend (留下空洞) 或 shrink */
+    off_t curr_size = inode.getsize();
     if (curr_size == size)
         return 0;
 
     if (curr_size < size) {
-        uint32_t diff = curr_size - size;
-        std::vector<char> buf(diff, 0);
-        int res = inode.write(size - curr_size, curr_size, buf.data());
+        int res = inode.extendto(size);
         if (res != 0)
             return -EIO;
     }
@@ -487,6 +737,15 @@ int fs::truncate(const char *path, off_t size) {
 }
 
 int fs::open(const char *path, struct fuse_file_info *fi) {
+    /* 统计文件：打开时生成一份快照，之后的 read 都读它 */
+    if (is_stats(path)) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EACCES;
+        fi->fh = (uint64_t) new std::string(stats.dump());
+        fi->direct_io = 1;
+        return 0;
+    }
+
     path_t p(path);
 
     uint32_t ino;
@@ -494,14 +753,12 @@ int fs::open(const char *path, struct fuse_file_info *fi) {
     if (res != 0)
         return res;
 
-    inode_t inode(ino);
-    inode.addref();
-    fi->fh = ino;
-
-    return 0;
+    /* 之后的 read/write 直接使用 fi->fh，不再查找路径 */
+    return open_ino(ino, fi);
 }
 
 int fs::create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    txn_t t;
     path_t p(path);
     path_t parent = p.parent_path();
     path_t name = p.filename();
@@ -518,43 +775,60 @@ int fs::create(const char *path, mode_t mode, struct fuse_file_info *fi) {
     if (res != 0)
         return res;
 
-    /* 如果 `path` 已存在，返回 */
-    if (d.lookup(name.c_str()) != 0)
-        return 0;
+    /* 如果 `path` 已存在，直接打开它 */
+    wlock_t l(d);
+    if (dead(d))
+        return -ENOENT;
+    uint32_t exist = d.lookup(name.c_str());
+    if (exist != 0)
+        return open_ino(exist, fi);
 
-    /* 找到一个未被使用的 inode */
-    uint32_t ino = Runtime::bitmap.imap.find_empty();
+    /* 分配一个未被使用的 inode */
+    uint32_t ino = Runtime::bitmap.alloc_ino();
+    if (ino == 0)
+        return -ENOSPC;
+
+    file_t *f = new file_t(ino);
+    if (f->inode.bad()) {
+        delete f;
+        Runtime::bitmap.free_ino(ino);
+        return -EIO;
+    }
 
     /* 创建 direntry */
     res = d.add(ino, name.c_str());
-    if (res != 0)
+    if (res != 0) {
         /* link 已满 */
+        delete f;
+        Runtime::bitmap.free_ino(ino);
         return -EMLINK;
+    }
 
-    /* 创建 inode */
-    Runtime::bitmap.imap.set(ino);
-    inode_t inode(ino);
-    inode.zero();
-    inode.setmode(mode);
-    inode.addref();
-
-    // fs::open(path, fi);
+    /* 创建 inode，并打开它 */
+    wlock_t il(f->inode);
+    f->inode.zero(new_extents);
+    f->inode.setmode(mode);
+    f->inode.addref();
+    f->inode.open();
+    fi->fh = (uint64_t)f;
 
     return 0;
 }
 
 int fs::read(const char *path, char *buf, size_t size, off_t offset,
              struct fuse_file_info *fi) {
+    if (is_stats(path)) {
+        std::string *s = (std::string *)fi->fh;
+        if (offset >= (off_t)s->size())
+            return 0;
+        size = std::min(size, s->size() - offset);
+        memcpy(buf, s->data() + offset, size);
+        return size;
+    }
 
-    path_t p(path);
-
-    uint32_t ino;
-    int res = getino(p, ino);
-    if (res != 0)
-        return res;
-
-    inode_t inode(ino);
-    int bytes_read = inode.read(size, offset, buf);
+    file_t *f = (file_t *)fi->fh;
+    rlock_t l(f->inode);
+    int bytes_read = f->inode.read(size, offset, buf, &f->state);
     if (bytes_read < 0)
         return -EIO;
 
@@ -563,31 +837,36 @@ int fs::read(const char *path, char *buf, size_t size, off_t offset,
 
 int fs::write(const char *path, const char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi) {
-
-    path_t p(path);
-
-    uint32_t ino;
-    int res = getino(p, ino);
-    if (res != 0)
-        return res;
-
-    inode_t inode(ino);
-    int bytes_write = inode.write(size, offset, buf);
-    if (res < 0)
+    txn_t t;
+    if (offset + size > MAX_FILE_SIZE)
+        return -EFBIG;
+
+    file_t *f = (file_t *)fi->fh;
+    wlock_t l(f->inode);
+    int bytes_write = f->inode.write(size, offset, buf);
+    if (bytes_write < 0)
         return -EIO;
     return bytes_write;
 }
 
+int fs::fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    if (Runtime::sync() != 0)
+        return -EIO;
+    return 0;
+}
+
 int fs::release(const char *path, struct fuse_file_info *fi) {
-    uint32_t ino = fi->fh;
-    inode_t inode(ino);
-    inode.deref();
+    if (is_stats(path)) {
+        delete (std::string *)fi->fh;
+        return 0;
+    }
+    txn_t t;
+    close_ino(fi);
     return 0;
 }
 int fs::releasedir(const char *path, struct fuse_file_info *fi) {
-    uint32_t ino = fi->fh;
-    inode_t inode(ino);
-    inode.deref();
+    txn_t t;
+    close_ino(fi);
     return 0;
 }
 
@@ -596,23 +875,78 @@ int fs::utimens(const char *path, const struct timespec tv[2]) { return 0; }
 } // namespace aqfs
 
 int main(int argc, char *argv[]) {
+    /**
+     * aqfs 自己的选项，位于 block device root 之前:
+     *   -m       mmap the image instead of pread/pwrite
+     *   -c N     cache N blocks in the buffer cache
+     *   -e       map the data of new files and dirs with extents
+     *   -t FILE  trace block I/O to FILE (built with AQFS_STATS)
+     */
+    int nopts = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0)
+            blk_mmap = true;
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            blk_nbufs = strtoul(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "-e") == 0)
+            new_extents = true;
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            trace_path = argv[++i];
+        else
+            break;
+        nopts = i;
+    }
+    for (int i = 1; i + nopts <= argc; i++)
+        argv[i] = argv[i + nopts];
+    argc -= nopts;
+
     if (argc < 2) {
-        std::cout << "usage: " << argv[0] << " [block device root] [fuse args]"
+        std::cout << "usage: " << argv[0]
+                  << " [-m] [-c nbufs] [-e] [-t trace]"
+                     " [block device root | image]"
+                     " [fuse args]"
                   << std::endl;
         return -1;
     }
 
-    strcpy(blk_root, argv[1]);
+    /* fuse 会 chdir("/")，因此需要绝对路径 */
+    char *root = realpath(argv[1], nullptr);
+    if (root == nullptr) {
+        perror(argv[1]);
+        return -1;
+    }
+    blk_root = root;
+    free(root);
 
-    for (int i = 1; i < argc - 1; i++)
+    /* 在 fuse chdir("/") 之前打开，相对路径才有效 */
+#ifdef AQFS_STATS
+    if (trace_path && aqfs::iostat.trace_open(trace_path) != 0) {
+        perror(trace_path);
+        return -1;
+    }
+#else
+    if (trace_path)
+        std::cerr << "built without AQFS_STATS, -t ignored" << std::endl;
+#endif
+
+    /* 多线程运行，需要单线程时可以自己加上 `-s` */
+    for (int i = 1; i < argc; i++)
         argv[i] = argv[i + 1];
+    argc--;
 
-    char single_thread[] = "-s";
-    argv[argc - 1] = single_thread;
+    /* 挂载之前打开 volume，打不开 (block size 不符、journal 无法重放) 就不挂载 */
+    if (aqfs::Runtime::init(blk_root, blk_mmap, blk_nbufs) != 0) {
+        std::cerr << blk_root << ": cannot open the volume" << std::endl;
+        return -1;
+    }
+    blk_open = true;
 
     static aqfs::fs fs;
 
-    fuse_main(argc, argv, &fs.op, NULL);
+    int res = fuse_main(argc, argv, &fs.op, NULL);
 
-    return 0;
+    /* 没有挂载成功时 destroy 不会被调用 */
+    if (blk_open)
+        aqfs::Runtime::fini();
+    return res;
 }
@@ -0,0 +1,655 @@
+#include "fs_ll.h"
+#include "dir.h"
+#include "file.h"
+#include "journal.h"
+#include "runtime.h"
+#include <cstring>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+static std::string blk_root = "/home/vagrant/fs";
+static bool blk_mmap = false;
+static size_t blk_nbufs = aqfs::BCACHE_NBUFS;
+/* the volume is open: from main, before mounting, until destroy */
+static bool blk_open = false;
+static bool new_extents = false; /* map new inodes with extents */
+using aqfs::dir_t;
+using aqfs::dirslot_t;
+using aqfs::file_t;
+using aqfs::inode_t;
+using aqfs::txn_t;
+typedef std::unique_lock<inode_t> wlock_t;
+typedef std::shared_lock<inode_t> rlock_t;
+
+/* nobody else changes the volume, the kernel may cache what we tell it */
+static const double TIMEOUT = 1.0;
+
+/*
+ * locking: as in fs.cpp, with the parent directories of a request in place
+ * of a path walk; rename_lock serializes renames, and requests that change
+ * the volume are transactions
+ */
+static std::mutex rename_lock;
+
+/*
+ * the inodes the kernel knows of, with their lookup counts
+ * a known inode is held like an open one: unlinked, it is freed only when
+ * the kernel forgets it, so its number is not given to another inode while
+ * the kernel may still send requests for it
+ */
+struct known_t {
+    inode_t inode; /* keeps the in-core inode */
+    uint64_t nlookup;
+};
+static std::unordered_map<fuse_ino_t, known_t> known;
+static std::mutex known_lock;
+
+/*
+ * the kernel looked up the locked `inode` once more
+ * the lock may be shared, it is known_lock that keeps the holds taken and
+ * given back here from racing
+ */
+static void remember(inode_t &inode) {
+    std::lock_guard<std::mutex> l(known_lock);
+    auto it = known.find(inode.getino());
+    if (it == known.end()) {
+        known.emplace(inode.getino(), known_t{inode, 1});
+        inode.open();
+    } else
+        it->second.nlookup++;
+}
+
+/* undo a remember() of the locked `inode`, linked, so nothing is freed */
+static void unremember(inode_t &inode) {
+    std::lock_guard<std::mutex> l(known_lock);
+    auto it = known.find(inode.getino());
+    if (--it->second.nlookup == 0) {
+        known.erase(it);
+        inode.close();
+    }
+}
+
+typedef std::unordered_map<fuse_ino_t, known_t>::node_type known_node;
+
+/* drop `nlookup` lookups of `ino`; the last one takes it out of `known` */
+static known_node drop(fuse_ino_t ino, uint64_t nlookup) {
+    std::lock_guard<std::mutex> l(known_lock);
+    auto it = known.find(ino);
+    if (it == known.end())
+        return {};
+    if (it->second.nlookup > nlookup) {
+        it->second.nlookup -= nlookup;
+        return {};
+    }
+    return known.extract(it);
+}
+
+/* the kernel forgets `nlookup` lookups of `ino`, the last one lets it go */
+static void forget_ino(fuse_ino_t ino, uint64_t nlookup) {
+    known_node k = drop(ino, nlookup);
+    if (k.empty())
+        return;
+    txn_t t;
+    wlock_t l(k.mapped().inode);
+    k.mapped().inode.close();
+}
+
+/* a directory removed while we were waiting for its lock */
+static bool dead(inode_t &inode) { return inode.getrefcount() == 0; }
+
+static bool isdir(inode_t &inode) {
+    return (inode.getmode() & S_IFDIR) == S_IFDIR;
+}
+
+/* is `d` below directory `anc`? to be asked under rename_lock */
+static bool below(dir_t d, uint32_t anc) {
+    while (d.getino() != 1) {
+        rlock_t l(d);
+        uint32_t up = d.lookup("..");
+        l.unlock();
+        if (up == anc)
+            return true;
+        if (up == 0 || up == d.getino())
+            return false;
+        d = dir_t(up);
+    }
+    return false;
+}
+
+/* `inode` is locked */
+static void fill_attr(inode_t &inode, struct stat *st) {
+    *st = {};
+    st->st_ino = inode.getino();
+    st->st_mode = inode.getmode();
+    st->st_nlink = inode.getrefcount();
+    st->st_size = inode.getsize();
+    st->st_blksize = aqfs::BLKSIZE;
+}
+
+/* reply with the entry of the locked `inode`, the kernel now knows of it */
+static void reply_entry(fuse_req_t req, inode_t &inode,
+                        struct fuse_file_info *fi = nullptr) {
+    struct fuse_entry_param e = {};
+    e.ino = inode.getino();
+    e.attr_timeout = e.entry_timeout = TIMEOUT;
+    fill_attr(inode, &e.attr);
+
+    remember(inode);
+    int res = fi ? fuse_reply_create(req, &e, fi) : fuse_reply_entry(req, &e);
+    /* the request was interrupted, the kernel did not get it */
+    if (res != 0) {
+        unremember(inode);
+        if (fi) {
+            file_t *f = (file_t *)fi->fh;
+            f->inode.close();
+            delete f;
+        }
+    }
+}
+
+/*
+ * create `name` in `parent`: a directory if `mode` says so, a symlink to
+ * `link` if given, else a file (opened with `fi`)
+ */
+static void make(fuse_req_t req, fuse_ino_t parent, const char *name,
+                 mode_t mode, const char *link,
+                 struct fuse_file_info *fi = nullptr) {
+    txn_t t;
+    dir_t d(parent);
+    if (d.bad())
+        return (void)fuse_reply_err(req, EIO);
+    wlock_t l(d);
+    if (dead(d))
+        return (void)fuse_reply_err(req, ENOENT);
+    if (!isdir(d))
+        return (void)fuse_reply_err(req, ENOTDIR);
+
+    /* 如果 `name` 已存在，返回 EEXIST */
+    if (d.lookup(name) != 0)
+        return (void)fuse_reply_err(req, EEXIST);
+
+    /* 分配一个未被使用的 inode，并创建 direntry */
+    uint32_t ino = aqfs::Runtime::bitmap.alloc_ino();
+    if (ino == 0)
+        return (void)fuse_reply_err(req, ENOSPC);
+    dir_t node(ino);
+    if (node.bad()) {
+        aqfs::Runtime::bitmap.free_ino(ino);
+        return (void)fuse_reply_err(req, EIO);
+    }
+    if (d.add(ino, name) != 0) {
+        aqfs::Runtime::bitmap.free_ino(ino);
+        return (void)fuse_reply_err(req, EMLINK);
+    }
+
+    wlock_t nl(node);
+    node.zero(new_extents);
+    node.setmode(mode);
+    node.addref();
+    if (S_ISDIR(mode)) {
+        /* 没有空间存放目录的第一个 block 时撤销创建 */
+        if (node.add(ino, ".") != 0) {
+            d.remove(name);
+            node.deref();
+            return (void)fuse_reply_err(req, ENOSPC);
+        }
+        node.add(d.getino(), "..");
+    }
+    if (link)
+        node.write(strlen(link) + 1, 0, link);
+    if (fi) {
+        file_t *f = new file_t(ino);
+        f->inode.open();
+        fi->fh = (uint64_t)f;
+    }
+    reply_entry(req, node, fi);
+}
+
+namespace aqfs {
+
+void fs_ll::init(void *userdata, struct fuse_conn_info *conn) {
+    /* main has opened the volume already */
+}
+
+void fs_ll::destroy(void *userdata) {
+    /* the kernel forgets everything on unmount, unlinked inodes go now */
+    for (auto &k : known) {
+        txn_t t;
+        wlock_t l(k.second.inode);
+        k.second.inode.close();
+    }
+    known.clear();
+    Runtime::fini();
+    blk_open = false;
+}
+
+void fs_ll::lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    dir_t d(parent);
+    if (d.bad())
+        return (void)fuse_reply_err(req, EIO);
+    rlock_t l(d);
+    uint32_t ino = d.lookup(name);
+    l.unlock();
+
+    /* ino 0 是一个可以缓存的否定 entry */
+    if (ino == 0) {
+        struct fuse_entry_param e = {};
+        e.entry_timeout = TIMEOUT;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    inode_t inode(ino);
+    if (inode.bad())
+        return (void)fuse_reply_err(req, EIO);
+    rlock_t il(inode);
+    /* unlinked since the lookup, and freed unless the kernel holds it */
+    if (dead(inode))
+        return (void)fuse_reply_err(req, ENOENT);
+    reply_entry(req, inode);
+}
+
+void fs_ll::forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    forget_ino(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+void fs_ll::getattr(fuse_req_t req, fuse_ino_t ino,
+                    struct fuse_file_info *fi) {
+    inode_t inode(ino);
+    if (inode.bad())
+        return (void)fuse_reply_err(req, EIO);
+    rlock_t l(inode);
+    struct stat st;
+    fill_attr(inode, &st);
+    fuse_reply_attr(req, &st, TIMEOUT);
+}
+
+void fs_ll::setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                    int to_set, struct fuse_file_info *fi) {
+    txn_t t;
+    inode_t inode(ino);
+    if (inode.bad())
+        return (void)fuse_reply_err(req, EIO);
+    wlock_t l(inode);
+
+    if (to_set & FUSE_SET_ATTR_MODE)
+        inode.setmode((inode.getmode() & S_IFMT) | (attr->st_mode & 07777));
+
+    /* 根据 size 关系来 extend (留下空洞) 或 shrink */
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        if (attr->st_size < 0)
+            return (void)fuse_reply_err(req, EINVAL);
+        if (attr->st_size > (off_t)MAX_FILE_SIZE)
+            return (void)fuse_reply_err(req, EFBIG);
+        size_t size = attr->st_size;
+        int res = 0;
+        if (size > inode.getsize())
+            res = inode.extendto(size);
+        else if (size < inode.getsize())
+            res = inode.shrinkto(size);
+        if (res != 0)
+            return (void)fuse_reply_err(req, EIO);
+    }
+
+    struct stat st;
+    fill_attr(inode, &st);
+    fuse_reply_attr(req, &st, TIMEOUT);
+}
+
+void fs_ll::readlink(fuse_req_t req, fuse_ino_t ino) {
+    inode_t inode(ino);
+    if (inode.bad())
+        return (void)fuse_reply_err(req, EIO);
+    rlock_t l(inode);
+    /* 写入时包含了结尾的 \0 */
+    std::vector<char> buf(inode.getsize() + 1);
+    if (inode.read(inode.getsize(), 0, buf.data()) < 0)
+        return (void)fuse_reply_err(req, EIO);
+    fuse_reply_readlink(req, buf.data());
+}
+
+void fs_ll::mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                  mode_t mode) {
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return (void)fuse_reply_err(req, EEXIST);
+    make(req, parent, name, S_IFDIR | (mode & 07777), nullptr);
+}
+
+void fs_ll::symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                    const char *name) {
+    make(req, parent, name, S_IFLNK | 0755, link);
+}
+
+void fs_ll::create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                   mode_t mode, struct fuse_file_info *fi) {
+    make(req, parent, name, mode, nullptr, fi);
+}
+
+void fs_ll::unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    txn_t t;
+    dir_t d(parent);
+    if (d.bad())
+        return (void)fuse_reply_err(req, EIO);
+    wlock_t l(d);
+    uint32_t ino = d.lookup(name);
+    if (ino == 0)
+        return (void)fuse_reply_err(req, ENOENT);
+
+    inode_t inode(ino);
+    if (inode.bad())
+        return (void)fuse_reply_err(req, EIO);
+    wlock_t il(inode);
+    inode.deref();
+    d.remove(name);
+    fuse_reply_err(req, 0);
+}
+
+void fs_ll::rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    txn_t t;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return (void)fuse_reply_err(req, EINVAL);
+
+    dir_t d(parent);
+    if (d.bad())
+        return (void)fuse_reply_err(req, EIO);
+    wlock_t l(d);
+    uint32_t ino = d.lookup(name);
+    if (ino == 0)
+        return (void)fuse_reply_err(req, ENOENT);
+    dir_t target(ino);
+    if (target.bad())
+        return (void)fuse_reply_err(req, EIO);
+    wlock_t tl(target);
+    if (!isdir(target))
+        return (void)fuse_reply_err(req, ENOTDIR);
+    if (target.hasChild())
+        return (void)fuse_reply_err(req, ENOTEMPTY);
+
+    d.remove(name);
+    target.deref();
+    fuse_reply_err(req, 0);
+}
+
+void fs_ll::rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                   fuse_ino_t newparent, const char *newname) {
+    txn_t t;
+    std::lock_guard<std::mutex> rl(rename_lock);
+    dir_t d(parent), to_d(newparent);
+    if (d.bad() || to_d.bad())
+        return (void)fuse_reply_err(req, EIO);
+
+    /* 按顺序锁住两个目录：祖先在前，否则 ino 小的在前 */
+    wlock_t l, to_l;
+    if (parent == newparent)
+        l = wlock_t(d);
+    else if (below(to_d, parent) ||
+             (!below(d, newparent) && parent < newparent)) {
+        l = wlock_t(d);
+        to_l = wlock_t(to_d);
+    } else {
+        to_l = wlock_t(to_d);
+        l = wlock_t(d);
+    }
+    if (dead(d) || dead(to_d))
+        return (void)fuse_reply_err(req, ENOENT);
+
+    uint32_t ino = d.lookup(name);
+    if (ino == 0)
+        return (void)fuse_reply_err(req, ENOENT);
+    dir_t inode(ino);
+    if (inode.bad())
+        return (void)fuse_reply_err(req, EIO);
+    wlock_t il(inode);
+
+    /*
+     * 目标已存在时像 unlink / rmdir 一样释放它；
+     * 是同一个 inode 时什么都不做
+     */
+    uint32_t old = to_d.lookup(newname);
+    if (old == ino)
+        return (void)fuse_reply_err(req, 0);
+    if (old != 0) {
+        dir_t victim(old);
+        if (victim.bad())
+            return (void)fuse_reply_err(req, EIO);
+        wlock_t vl(victim);
+        if (isdir(victim) != isdir(inode))
+            return (void)fuse_reply_err(req,
+                                        isdir(victim) ? EISDIR : ENOTDIR);
+        if (isdir(victim) && victim.hasChild())
+            return (void)fuse_reply_err(req, ENOTEMPTY);
+        if (to_d.remove(newname) != 0)
+            return (void)fuse_reply_err(req, EIO);
+        victim.deref();
+    }
+
+    if (to_d.add(ino, newname) != 0)
+        return (void)fuse_reply_err(req, EMLINK);
+    d.remove(name);
+
+    /* 移到另一个目录下的目录，`..` 也要跟着改 */
+    if (isdir(inode) && parent != newparent) {
+        inode.remove("..");
+        inode.add(newparent, "..");
+    }
+    fuse_reply_err(req, 0);
+}
+
+void fs_ll::link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                 const char *newname) {
+    txn_t t;
+    dir_t to_d(newparent);
+    if (to_d.bad())
+        return (void)fuse_reply_err(req, EIO);
+    wlock_t l(to_d);
+    if (dead(to_d))
+        return (void)fuse_reply_err(req, ENOENT);
+    inode_t inode(ino);
+    if (inode.bad())
+        return (void)fuse_reply_err(req, EIO);
+    wlock_t il(inode);
+    if (dead(inode))
+        return (void)fuse_reply_err(req, ENOENT);
+
+    /* 确认它不是一个目录 (POSIX.1) */
+    if (isdir(inode))
+        return (void)fuse_reply_err(req, EPERM);
+
+    if (to_d.add(ino, newname) != 0)
+        return (void)fuse_reply_err(req, EMLINK);
+    inode.addref();
+    reply_entry(req, inode);
+}
+
+void fs_ll::open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    file_t *f = new file_t(ino);
+    if (f->inode.bad()) {
+        delete f;
+        return (void)fuse_reply_err(req, EIO);
+    }
+    wlock_t l(f->inode);
+    if (dead(f->inode)) {
+        l.unlock();
+        delete f;
+        return (void)fuse_reply_err(req, ENOENT);
+    }
+    f->inode.open();
+    fi->fh = (uint64_t)f;
+    if (fuse_reply_open(req, fi) != 0) {
+        f->inode.close();
+        l.unlock();
+        delete f;
+    }
+}
+
+void fs_ll::release(fuse_req_t req, fuse_ino_t ino,
+                    struct fuse_file_info *fi) {
+    txn_t t;
+    file_t *f = (file_t *)fi->fh;
+    wlock_t l(f->inode);
+    f->inode.close();
+    l.unlock();
+    delete f;
+    fuse_reply_err(req, 0);
+}
+
+void fs_ll::read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                 struct fuse_file_info *fi) {
+    std::vector<char> buf(size);
+    file_t *f = (file_t *)fi->fh;
+    rlock_t l(f->inode);
+    int n = f->inode.read(size, off, buf.data(), &f->state);
+    l.unlock();
+    if (n < 0)
+        return (void)fuse_reply_err(req, EIO);
+    fuse_reply_buf(req, buf.data(), n);
+}
+
+void fs_ll::write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                  size_t size, off_t off, struct fuse_file_info *fi) {
+    txn_t t;
+    if (off + size > MAX_FILE_SIZE)
+        return (void)fuse_reply_err(req, EFBIG);
+    file_t *f = (file_t *)fi->fh;
+    wlock_t l(f->inode);
+    int n = f->inode.write(size, off, buf);
+    l.unlock();
+    if (n < 0)
+        return (void)fuse_reply_err(req, EIO);
+    fuse_reply_write(req, n);
+}
+
+void fs_ll::fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                  struct fuse_file_info *fi) {
+    fuse_reply_err(req, Runtime::sync() != 0 ? EIO : 0);
+}
+
+/* `off` is the position of the next entry, see dirslot_t */
+void fs_ll::readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                    struct fuse_file_info *fi) {
+    dir_t d(ino);
+    if (d.bad())
+        return (void)fuse_reply_err(req, EIO);
+    std::vector<char> buf(size);
+    size_t len = 0, pos = off;
+    for (int more = 1; more == 1;) {
+        std::vector<dirslot_t> slots;
+        rlock_t l(d);
+        more = d.read(pos, slots);
+        l.unlock();
+        if (more < 0)
+            return (void)fuse_reply_err(req, EIO);
+
+        /* 只需要 st_ino 和 st_mode 的类型位，整批一起取 */
+        std::vector<uint32_t> inos(slots.size());
+        std::vector<mode_t> modes(slots.size());
+        for (size_t i = 0; i < slots.size(); i++)
+            inos[i] = slots[i].entry.ino;
+        Runtime::icache.modes(slots.size(), inos.data(), modes.data());
+
+        for (size_t i = 0; i < slots.size(); i++) {
+            struct stat st = {};
+            st.st_ino = inos[i];
+            st.st_mode = modes[i];
+            size_t n = fuse_add_direntry(req, buf.data() + len, size - len,
+                                         slots[i].entry.name, &st,
+                                         slots[i].pos + 1);
+            if (n > size - len)
+                return (void)fuse_reply_buf(req, buf.data(), len);
+            len += n;
+        }
+    }
+    fuse_reply_buf(req, buf.data(), len);
+}
+
+} // namespace aqfs
+
+int main(int argc, char *argv[]) {
+    /**
+     * 选项与 aqfs.fuse 相同，位于 block device root 之前:
+     *   -m       mmap the image instead of pread/pwrite
+     *   -c N     cache N blocks in the buffer cache
+     *   -e       map the data of new files and dirs with extents
+     */
+    int nopts = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0)
+            blk_mmap = true;
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            blk_nbufs = strtoul(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "-e") == 0)
+            new_extents = true;
+        else
+            break;
+        nopts = i;
+    }
+    for (int i = 1; i + nopts <= argc; i++)
+        argv[i] = argv[i + nopts];
+    argc -= nopts;
+
+    if (argc < 3) {
+        std::cout << "usage: " << argv[0]
+                  << " [-m] [-c nbufs] [-e] [block device root | image]"
+                     " <mountpoint> [fuse args]"
+                  << std::endl;
+        return -1;
+    }
+
+    /* fuse 会 chdir("/")，因此需要绝对路径 */
+    char *root = realpath(argv[1], nullptr);
+    if (root == nullptr) {
+        perror(argv[1]);
+        return -1;
+    }
+    blk_root = root;
+    free(root);
+
+    for (int i = 1; i < argc; i++)
+        argv[i] = argv[i + 1];
+    argc--;
+
+    static aqfs::fs_ll fs;
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    char *mountpoint = nullptr;
+    int multithreaded = 0, foreground = 0;
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded,
+                           &foreground) != 0)
+        return -1;
+
+    /* 挂载之前打开 volume，打不开 (block size 不符、journal 无法重放) 就不挂载 */
+    if (aqfs::Runtime::init(blk_root, blk_mmap, blk_nbufs) != 0) {
+        std::cerr << blk_root << ": cannot open the volume" << std::endl;
+        free(mountpoint);
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    blk_open = true;
+
+    int res = -1;
+    struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+    if (ch != nullptr) {
+        struct fuse_session *se =
+            fuse_lowlevel_new(&args, &fs.op, sizeof(fs.op), nullptr);
+        if (se != nullptr) {
+            if (fuse_set_signal_handlers(se) == 0) {
+                fuse_session_add_chan(se, ch);
+                fuse_daemonize(foreground);
+                res = multithreaded ? fuse_session_loop_mt(se)
+                                    : fuse_session_loop(se);
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    /* 没有挂载成功时 destroy 不会被调用 */
+    if (blk_open)
+        aqfs::Runtime::fini();
+    free(mountpoint);
+    fuse_opt_free_args(&args);
+    return res == 0 ? 0 : 1;
+}
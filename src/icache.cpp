@@ -0,0 +1,202 @@
+#include "icache.h"
+#include "runtime.h"
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <vector>
+
+namespace aqfs {
+
+void icache_t::init(size_t ninodes) {
+    this->ninodes = ninodes;
+    this->hits = this->misses = 0;
+}
+
+/* an in-core inode leaves, unpinning what its map cache holds */
+static void drop(icnode_t *ic) {
+    for (auto &it : ic->mapbufs)
+        Runtime::bcache.put(it.second);
+    delete ic;
+}
+
+int icache_t::fini() {
+    int res = this->flush();
+    for (auto &it : this->table)
+        drop(it.second);
+    this->table.clear();
+    this->lru.clear();
+    return res;
+}
+
+icnode_t *icache_t::get(uint32_t ino) {
+    std::unique_lock<std::mutex> l(this->lock);
+    auto it = this->table.find(ino);
+    if (it != this->table.end()) {
+        icnode_t *ic = it->second;
+        if (ic->nref++ == 0)
+            this->lru.erase(ic->lru);
+        this->hits++;
+        /* another thread is reading it in */
+        this->loaded.wait(l, [ic] { return !ic->loading; });
+        if (!ic->valid) {
+            if (--ic->nref == 0)
+                drop(ic);
+            return nullptr;
+        }
+        return ic;
+    }
+
+    this->misses++;
+    icnode_t *ic = new icnode_t;
+    ic->ino = ino;
+    ic->nref = 1;
+    ic->dirty = false;
+    ic->dirhint = 0;
+    ic->nopen = 0;
+    ic->mapgen = 0;
+    ic->loading = true;
+    this->table[ino] = ic;
+
+    /* read in without the lock, others asking for it wait in get() */
+    l.unlock();
+    int res = ic->inode.load_from_ino(ino);
+    l.lock();
+    ic->loading = false;
+    ic->valid = res == 0;
+    this->loaded.notify_all();
+    if (ic->valid)
+        return ic;
+
+    /* not kept, so that the next get() tries again */
+    this->table.erase(ino);
+    if (--ic->nref == 0)
+        drop(ic);
+    return nullptr;
+}
+
+void icache_t::put(icnode_t *ic) {
+    /* a stand-in of inode_t for an inode that could not be read in */
+    if (!ic->valid) {
+        drop(ic);
+        return;
+    }
+    std::unique_lock<std::mutex> l(this->lock);
+    if (--ic->nref > 0)
+        return;
+    this->lru.push_back(ic);
+    ic->lru = std::prev(this->lru.end());
+    if (this->lru.size() <= this->ninodes)
+        return;
+
+    /*
+     * evict the oldest unreferenced inodes; dirty ones are written back by
+     * the next commit (in one piece with the operation that changed them),
+     * and are moved to the back until then, looking at a few per call
+     */
+    size_t scan = ICACHE_EVICT_SCAN;
+    for (auto it = this->lru.begin(); it != this->lru.end() &&
+                                      this->lru.size() > this->ninodes &&
+                                      scan-- > 0;) {
+        icnode_t *old = *it;
+        it = std::next(it);
+        if (old->dirty) {
+            this->lru.splice(this->lru.end(), this->lru, old->lru);
+            continue;
+        }
+        this->lru.erase(old->lru);
+        this->table.erase(old->ino);
+        drop(old);
+    }
+}
+
+void icache_t::modes(size_t n, const uint32_t *inos, mode_t *modes) {
+    /* in inode number order, so inodes sharing a block come together */
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++)
+        order[i] = i;
+    std::sort(order.begin(), order.end(),
+              [inos](size_t a, size_t b) { return inos[a] < inos[b]; });
+
+    /*
+     * in-core inodes are pinned and read under their own lock once the
+     * table is unlocked; the others are up to date in their blocks, as
+     * inodes are written back before they leave the table, and whatever
+     * happens to them later does not change their type
+     */
+    std::vector<icnode_t *> core(n, nullptr);
+    std::unique_lock<std::mutex> l(this->lock);
+    for (size_t i : order) {
+        auto it = this->table.find(inos[i]);
+        /* one being read in has its block up to date too */
+        if (it == this->table.end() || it->second->loading)
+            continue;
+        core[i] = it->second;
+        if (core[i]->nref++ == 0)
+            this->lru.erase(core[i]->lru);
+    }
+    l.unlock();
+
+    buf_t *b = nullptr;
+    for (size_t i : order) {
+        if (core[i] != nullptr)
+            continue;
+        uint32_t blkno = Runtime::super.iblk(inos[i]);
+        if (b == nullptr || b->blkno != blkno) {
+            if (b)
+                Runtime::bcache.put(b);
+            b = Runtime::bcache.get(blkno);
+        }
+        struct inode_blk *blk = b ? (struct inode_blk *)b->data : nullptr;
+        modes[i] = blk ? blk->inodes[inos[i] % INODES_PER_BLK].mode : 0;
+    }
+    if (b)
+        Runtime::bcache.put(b);
+
+    for (size_t i = 0; i < n; i++) {
+        if (core[i] == nullptr)
+            continue;
+        core[i]->lock.lock_shared();
+        modes[i] = core[i]->inode.mode;
+        core[i]->lock.unlock_shared();
+        this->put(core[i]);
+    }
+}
+
+int icache_t::flush() {
+    Runtime::bcache.begin_batch();
+    /* group dirty inodes by inode block, keeping them in core */
+    std::map<uint32_t, std::vector<icnode_t *>> blks;
+    std::unique_lock<std::mutex> l(this->lock);
+    for (auto &it : this->table) {
+        icnode_t *ic = it.second;
+        if (!ic->dirty)
+            continue;
+        if (ic->nref++ == 0)
+            this->lru.erase(ic->lru);
+        blks[Runtime::super.iblk(it.first)].push_back(ic);
+    }
+    l.unlock();
+
+    int res = 0;
+    for (auto &blk : blks) {
+        buf_t *b = Runtime::bcache.get(blk.first);
+        for (icnode_t *ic : blk.second) {
+            int blkpos = (ic->ino % INODES_PER_BLK) * sizeof(struct inode);
+            if (b) {
+                std::shared_lock<std::shared_mutex> il(ic->lock);
+                std::memcpy(b->data + blkpos, &ic->inode,
+                            sizeof(struct inode));
+                ic->dirty = false;
+            }
+            this->put(ic);
+        }
+        if (b == nullptr)
+            res = -1;
+        else
+            Runtime::bcache.put(b, true);
+    }
+    Runtime::bcache.end_batch();
+    return res;
+}
+
+} // namespace aqfs
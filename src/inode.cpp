@@ -1,163 +1,842 @@
 #include "inode.h"
 #include "cstring"
 #include "runtime.h"
+#include "stats.h"
+#include <algorithm>
+#include <vector>
 #define MIN(a, b) ((a < b) ? a : b)
+#define MAX(a, b) ((a > b) ? a : b)
 
 namespace aqfs {
 
 int inode::save_to_ino(uint32_t ino) {
     /* 计算 block 编号 和内部字节偏移 */
-    int blkno = BASE_INODE_BLK + ino / INODES_PER_BLK;
+    uint32_t blkno = Runtime::super.iblk(ino);
     int blkpos = (ino % INODES_PER_BLK) * sizeof(struct inode);
-    /* 从 block 中读取数据到 buf */
-    char buf[BLKSIZE];
-    int res = Runtime::disk.read(blkno, buf);
-    if (res != 0)
-        return -1;
-    /* 将 inode 信息写入 */
-    std::memcpy(buf + blkpos, this, sizeof(struct inode));
-    /* 将 buf 写回到 block */
-    res = Runtime::disk.write(blkno, buf);
-    if (res != 0)
+    /* 在 buffer cache 中直接修改 inode 所在的 block */
+    buf_t *b = Runtime::bcache.get(blkno);
+    if (b == nullptr)
         return -1;
+    std::memcpy(b->data + blkpos, this, sizeof(struct inode));
+    Runtime::bcache.put(b, true);
     return 0;
 }
 
-int inode_t::fill() {
+int inode::load_from_ino(uint32_t ino) {
+    /* 尚未初始化的 inode block 先清零 */
+    if (Runtime::super.izero(ino) != 0)
+        return -1;
     /* 计算 block 编号和内部字节偏移 */
-    int blkno = BASE_INODE_BLK + this->ino / INODES_PER_BLK;
-    int blkpos = (this->ino % INODES_PER_BLK) * sizeof(struct inode);
-    /* 从 block 中读取数据 */
-    char buf[BLKSIZE];
-    int res = Runtime::disk.read(blkno, buf);
-    if (res != 0)
-        return res;
-    /* 拷贝相应位置的数据到 struct inode */
-    std::memcpy(&this->inode, buf + blkpos, sizeof(struct inode));
+    uint32_t blkno = Runtime::super.iblk(ino);
+    int blkpos = (ino % INODES_PER_BLK) * sizeof(struct inode);
+    /* 从 buffer cache 中拷贝相应位置的数据到 struct inode */
+    buf_t *b = Runtime::bcache.get(blkno);
+    if (b == nullptr)
+        return -1;
+    std::memcpy(this, b->data + blkpos, sizeof(struct inode));
+    Runtime::bcache.put(b);
+    return 0;
+}
+
+/* the in-core inode of `ino`, or a stand-in if it can not be read in */
+static icnode_t *get_ic(uint32_t ino) {
+    icnode_t *ic = Runtime::icache.get(ino);
+    if (ic != nullptr)
+        return ic;
+    ic = new icnode_t();
+    ic->ino = ino;
+    ic->nref = 1;
+    ic->valid = false;
+    return ic;
+}
+
+inode_t::inode_t(uint32_t ino) {
+    this->ino = ino;
+    this->ic = get_ic(ino);
+}
+
+inode_t::inode_t(const inode_t &other) {
+    this->ino = other.ino;
+    this->ic = get_ic(other.ino);
+}
+
+inode_t &inode_t::operator=(const inode_t &other) {
+    if (this->ic != other.ic) {
+        Runtime::icache.put(this->ic);
+        this->ic = get_ic(other.ino);
+    }
+    this->ino = other.ino;
+    return *this;
+}
+
+inode_t::~inode_t() { Runtime::icache.put(this->ic); }
+
+inode_t::inode_t(icnode_t *ic) {
+    this->ino = ic->ino;
+    this->ic = ic;
+}
+
+/* 与 get_ic 的替身一样不在 inode cache 中，put() 时直接丢弃 */
+inode_t inode_t::scratch() {
+    icnode_t *ic = new icnode_t();
+    ic->ino = this->ino;
+    ic->nref = 1;
+    ic->valid = false;
+    ic->inode.mode = this->ic->inode.mode;
+    if (this->ic->inode.isextents())
+        ic->inode.extents()->hdr.magic = EXTENT_MAGIC;
+    return inode_t(ic);
+}
+
+void inode_t::swap_map(inode_t &other) {
+    struct inode &a = this->ic->inode, &b = other.ic->inode;
+    std::swap(a.size, b.size);
+    std::swap(a.size_hi, b.size_hi);
+    std::swap(a.direct, b.direct);
+    std::swap(a.single_indrect, b.single_indrect);
+    std::swap(a.double_indrect, b.double_indrect);
+    std::swap(a.triple_indrect, b.triple_indrect);
+    {
+        /* 各自缓存的 interior block 跟着 map 走 */
+        std::scoped_lock l(this->ic->maplock, other.ic->maplock);
+        std::swap(this->ic->mapbufs, other.ic->mapbufs);
+    }
+    this->ic->mapgen++;
+    other.ic->mapgen++;
+    this->ic->dirty = true;
+    other.ic->dirty = true;
+}
+
+/* a block of the block map or an extent leaf, known as such to iostat */
+static buf_t *map_get(uint32_t blkno, bool fill = true) {
+#ifdef AQFS_STATS
+    iostat.tag(blkno, BLK_INDIRECT);
+#endif
+    return Runtime::bcache.get(blkno, fill);
+}
+
+/*
+ * a newly allocated block starts out zeroed, in the buffer cache; it is not
+ * metadata (yet), so the zeroes go in place before the link is committed
+ */
+static int zero_blk(uint32_t blkno) {
+    buf_t *b = Runtime::bcache.get(blkno, false);
+    if (b == nullptr)
+        return -1;
+    memset(b->data, 0, BLKSIZE);
+    Runtime::bcache.put(b, true, true);
     return 0;
 }
 
 /*
- * 找到 inode 连接的第 n 个 block 的编号。
- * 如果编号为 0 且 alloc 为真，那么初始化一个新的 block。
- * 必要时 free 掉 indirect blk
+ * 逻辑 block m 的链接所在的 indirect block：
+ * 前 SINGLE_INDRECT_BLKS_PER_INODE 块由 single indirect 直接指向，
+ * 之后依次经过 double indirect (一层) 和 triple indirect (两层) 的中间 block
  */
-uint32_t inode_t::blk_walk(size_t n, bool alloc, bool free) {
-    uint32_t *blkno;
-    blkbuf_t indirect(0);
-    if (n > (this->inode.size - 1) / BLKSIZE)
+buf_t *inode_t::map_leaf(size_t m, bool alloc, uint32_t goal, bool &err) {
+    const size_t L = INDRECT_LINK_PER_BLK;
+    size_t path[2];
+    int depth;
+    uint32_t *root;
+    m -= DIRECT_BLKS_PER_INODE;
+    if (m < SINGLE_INDRECT_BLKS_PER_INODE * L) {
+        depth = 0;
+        root = &this->ic->inode.single_indrect[m / L];
+    } else if ((m -= SINGLE_INDRECT_BLKS_PER_INODE * L) < L * L) {
+        depth = 1;
+        root = &this->ic->inode.double_indrect;
+        path[0] = m / L;
+    } else if ((m -= L * L) < L * L * L) {
+        depth = 2;
+        root = &this->ic->inode.triple_indrect;
+        path[0] = m / (L * L);
+        path[1] = m / L % L;
+    } else {
+        err = true;
+        return nullptr;
+    }
+
+    if (*root == 0) {
+        if (!alloc)
+            return nullptr;
+        if ((*root = this->map_new(goal)) == 0) {
+            err = true;
+            return nullptr;
+        }
+        this->ic->dirty = true;
+    }
+    uint32_t blkno = *root;
+    for (int d = 0; d < depth; d++) {
+        buf_t *b = this->map_interior(blkno);
+        if (b == nullptr) {
+            err = true;
+            return nullptr;
+        }
+        uint32_t *link = (uint32_t *)b->data + path[d];
+        bool changed = false;
+        if (*link == 0 && alloc) {
+            *link = this->map_new(goal ? goal : blkno + 1);
+            changed = *link != 0;
+        }
+        blkno = *link;
+        Runtime::bcache.put(b, changed);
+        if (blkno == 0) {
+            err = alloc;
+            return nullptr;
+        }
+    }
+    buf_t *leaf = map_get(blkno);
+    if (leaf == nullptr)
+        err = true;
+    return leaf;
+}
+
+buf_t *inode_t::map_interior(uint32_t blkno) {
+    buf_t *b = map_get(blkno);
+    if (b == nullptr)
+        return nullptr;
+    std::lock_guard<std::mutex> l(this->ic->maplock);
+    auto &bufs = this->ic->mapbufs;
+    if (bufs.size() < MAP_CACHE_BLKS && bufs.find(blkno) == bufs.end())
+        bufs[blkno] = Runtime::bcache.get(blkno);
+    return b;
+}
+
+/* 新的 indirect block 可能是刚释放的 block，需要清零 */
+uint32_t inode_t::map_new(uint32_t goal) {
+    uint32_t blkno = this->balloc(goal);
+    if (blkno == 0)
         return 0;
-    if (n >= DIRECT_BLKS_PER_INODE +
-                 SINGLE_INDRECT_BLKS_PER_INODE * INDRECT_LINK_PER_BLK)
+    buf_t *b = map_get(blkno, false);
+    if (b == nullptr) {
+        this->bfree(blkno);
         return 0;
-    if (n < DIRECT_BLKS_PER_INODE)
-        blkno = &this->inode.direct[n];
-    else {
-        uint32_t *indrect_blkno;
-        size_t idx_for_indirect_blk =
-            (n - DIRECT_BLKS_PER_INODE) / INDRECT_LINK_PER_BLK;
-        size_t idx_in_indirect_blk =
-            (n - DIRECT_BLKS_PER_INODE) % INDRECT_LINK_PER_BLK;
-
-        indrect_blkno = &this->inode.single_indrect[idx_for_indirect_blk];
-
-        // 如果 indirect block 并没有被 allocate
-        if (*indrect_blkno == 0) {
-            if (!alloc)
-                return 0;
-            *indrect_blkno = Runtime::bitmap.dmap.find_empty();
-            if (*indrect_blkno == 0)
-                return 0;
-            Runtime::bitmap.dmap.set(*indrect_blkno);
-            this->dirty = true;
-            indirect = blkbuf_t(*indrect_blkno);
-            memset(&indirect.data, 0, BLKSIZE);
-        }
-        // 从磁盘读取 indirect block
-        indirect = blkbuf_t(*indrect_blkno);
-        indirect.fill();
-        blkno = (uint32_t *)(&indirect.data) + idx_in_indirect_blk;
-    }
-
-    if (alloc && *blkno == 0) {
-        *blkno = Runtime::bitmap.dmap.find_empty();
-        if (*blkno == 0)
-            return 0;
-        Runtime::bitmap.dmap.set(*blkno);
-        // changed link in indirect blk or inode, need to flush changes
-        if (indirect.blkno != 0)
-            indirect.persist();
-        else
-            this->dirty = true;
-        // initialize an empty data block
-        blkbuf_t blkbuf(*blkno);
-        memset(&blkbuf.data, 0, BLKSIZE);
-        blkbuf.persist();
-    }
-
-    if (free && *blkno != 0) {
-        Runtime::bitmap.dmap.reset(*blkno);
-        *blkno = 0;
-        // 为直接连接，在 inode 中
-        if (indirect.blkno == 0)
-            this->dirty = true;
-        // 为间接连接，在 indirect 中
+    }
+    memset(b->data, 0, BLKSIZE);
+    Runtime::bcache.put(b, true);
+    return blkno;
+}
+
+void inode_t::map_trunc(uint32_t &blkno, int depth, size_t first,
+                        size_t keep) {
+    size_t span = 1; /* logical blocks behind one link */
+    for (int d = 1; d < depth; d++)
+        span *= INDRECT_LINK_PER_BLK;
+    if (blkno == 0 || first + span * INDRECT_LINK_PER_BLK <= keep)
+        return;
+    buf_t *b = map_get(blkno);
+    if (b == nullptr)
+        return;
+    uint32_t *links = (uint32_t *)b->data;
+    bool changed = false;
+    for (size_t i = 0; i < INDRECT_LINK_PER_BLK; i++) {
+        size_t from = first + i * span;
+        if (links[i] == 0 || from + span <= keep)
+            continue;
+        if (depth == 1) {
+            this->bfree(links[i]);
+            links[i] = 0;
+        } else
+            this->map_trunc(links[i], depth - 1, from, keep);
+        changed = true;
+    }
+    if (first < keep) {
+        Runtime::bcache.put(b, changed);
+        return;
+    }
+
+    // 整个 block 不再需要，先从 map cache 中移除
+    if (depth > 1) {
+        std::lock_guard<std::mutex> l(this->ic->maplock);
+        auto it = this->ic->mapbufs.find(blkno);
+        if (it != this->ic->mapbufs.end()) {
+            Runtime::bcache.put(it->second);
+            this->ic->mapbufs.erase(it);
+        }
+    }
+    Runtime::bcache.put(b);
+    this->bfree(blkno);
+    blkno = 0;
+}
+
+/* the last extent with lblk <= n, -1 if none */
+static int ext_search(const extent_t *ents, int nent, uint32_t n) {
+    int lo = 0, hi = nent;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ents[mid].lblk <= n)
+            lo = mid + 1;
         else
-            indirect.persist();
+            hi = mid;
     }
+    return lo - 1;
+}
+
+/* one node on the way from the root of an extent tree down to a leaf */
+struct ext_node {
+    buf_t *buf; /* nullptr for the root, which is in the inode */
+    extent_hdr *hdr;
+    extent_t *ent;
+    int cap;
+    int idx; /* the entry followed down to the next level */
+};
 
-    return *blkno;
+/* put back the blocks of path[1..depth] not put back already */
+static void ext_put(ext_node *path, int depth) {
+    for (int d = depth; d > 0; d--)
+        if (path[d].buf)
+            Runtime::bcache.put(path[d].buf);
 }
 
-void inode_t::destory() {}
+/*
+ * the nodes from the root (path[0]) down to the leaf of logical block n,
+ * the leaf at path[depth]; returns the depth, -1 if a node can not be read
+ */
+static int ext_path(extent_root *root, size_t n, ext_node *path) {
+    int depth = root->hdr.depth;
+    if (depth > EXT_MAX_DEPTH)
+        return -1;
+    path[0] = {nullptr, &root->hdr, root->ent, EXTENTS_IN_INODE, 0};
+    for (int d = 0; d < depth; d++) {
+        ext_node &p = path[d];
+        if (p.hdr->nent == 0) {
+            ext_put(path, d);
+            return -1;
+        }
+        p.idx = std::max(ext_search(p.ent, p.hdr->nent, n), 0);
+        buf_t *b = map_get(p.ent[p.idx].pblk);
+        if (b == nullptr) {
+            ext_put(path, d);
+            return -1;
+        }
+        extent_blk *eb = (extent_blk *)b->data;
+        path[d + 1] = {b, &eb->hdr, eb->ent, EXTENTS_PER_BLK, 0};
+    }
+    return depth;
+}
 
-int inode_t::get_blk(size_t n, blkbuf_t *blkbuf) {
-    uint32_t blkno = this->blk_walk(n, true);
-    if (blkno == 0)
+/*
+ * extent 映射的 inode 的第 n 个 block 的编号，alloc 为真时为空洞分配一个。
+ * 分配的 block 尽量接在前一个 extent 之后，以便直接延长该 extent；
+ * leaf 已满时先 ext_grow() 再重试。
+ * 新分配的 block 不会被清零，由调用者负责
+ */
+uint32_t inode_t::ext_walk(size_t n, bool alloc) {
+    ext_node path[EXT_MAX_DEPTH + 1];
+    int depth = ext_path(this->ic->inode.extents(), n, path);
+    if (depth < 0)
+        return 0;
+    extent_hdr *hdr = path[depth].hdr;
+    extent_t *ents = path[depth].ent;
+    int cap = path[depth].cap;
+
+    int i = ext_search(ents, hdr->nent, n);
+    uint32_t blkno = 0;
+    if (i >= 0 && n < ents[i].lblk + ents[i].len)
+        blkno = ents[i].pblk + (n - ents[i].lblk);
+    bool changed = false, full = false;
+
+    if (alloc && blkno == 0) {
+        uint32_t goal = i >= 0 ? ents[i].pblk + (n - ents[i].lblk) : 0;
+        blkno = this->balloc(goal);
+        if (blkno != 0 && i >= 0 && ents[i].lblk + ents[i].len == n &&
+            ents[i].pblk + ents[i].len == blkno) {
+            ents[i].len++;
+            changed = true;
+        } else if (blkno != 0 && hdr->nent < cap) {
+            memmove(&ents[i + 2], &ents[i + 1],
+                    (hdr->nent - i - 1) * sizeof(extent_t));
+            ents[i + 1] = {(uint32_t)n, blkno, 1};
+            hdr->nent++;
+            changed = true;
+        } else if (blkno != 0) {
+            this->bfree(blkno);
+            blkno = 0;
+            full = true;
+        }
+    }
+
+    if (depth > 0) {
+        Runtime::bcache.put(path[depth].buf, changed);
+        path[depth].buf = nullptr;
+    } else if (changed)
+        this->ic->dirty = true;
+    ext_put(path, depth);
+
+    if (full) {
+        if (this->ext_grow(n) != 0)
+            return 0;
+        return this->ext_walk(n, alloc);
+    }
+    return blkno;
+}
+
+uint32_t inode_t::ext_lookup(size_t n, size_t &len) {
+    ext_node path[EXT_MAX_DEPTH + 1];
+    int depth = ext_path(this->ic->inode.extents(), n, path);
+    if (depth < 0) {
+        len = 1;
+        return 0;
+    }
+    extent_hdr *hdr = path[depth].hdr;
+    extent_t *ents = path[depth].ent;
+
+    int i = ext_search(ents, hdr->nent, n);
+    uint32_t blkno = 0;
+    if (i >= 0 && n < ents[i].lblk + ents[i].len) {
+        blkno = ents[i].pblk + (n - ents[i].lblk);
+        len = ents[i].lblk + ents[i].len - n;
+    } else if (i + 1 < hdr->nent)
+        len = ents[i + 1].lblk - n;
+    else
+        len = 1;
+
+    ext_put(path, depth);
+    return blkno;
+}
+
+/*
+ * 从 n 所在的 leaf 往上找到第一个未满的 node，把它下面已满的 node
+ * 一分为二；直到 root 都已满时，root 中的内容移到一个新的 block 中，
+ * 树增高一层。每次只做一步
+ */
+int inode_t::ext_grow(size_t n) {
+    extent_root *root = this->ic->inode.extents();
+    ext_node path[EXT_MAX_DEPTH + 1];
+    int depth = ext_path(root, n, path);
+    if (depth < 0)
+        return -1;
+    int d = depth;
+    while (d >= 0 && path[d].hdr->nent == path[d].cap)
+        d--;
+    if (d == depth) {
+        ext_put(path, depth);
+        return 0;
+    }
+
+    if (d < 0) {
+        // root 的内容移到一个新的 node 中
+        ext_put(path, depth);
+        if (root->hdr.depth == EXT_MAX_DEPTH)
+            return -1;
+        uint32_t blkno = this->balloc(root->ent[0].pblk);
+        if (blkno == 0)
+            return -1;
+        buf_t *b = map_get(blkno, false);
+        if (b == nullptr) {
+            this->bfree(blkno);
+            return -1;
+        }
+        extent_blk *eb = (extent_blk *)b->data;
+        memset(b->data, 0, BLKSIZE);
+        eb->hdr = {EXTENT_MAGIC, root->hdr.nent, root->hdr.depth};
+        memcpy(eb->ent, root->ent, root->hdr.nent * sizeof(extent_t));
+        Runtime::bcache.put(b, true);
+
+        root->hdr.depth++;
+        root->hdr.nent = 1;
+        root->ent[0] = {0, blkno, 0};
+        this->ic->dirty = true;
+        return 0;
+    }
+
+    // 将 node 的后一半分到一个新的 node 中，树最右边的 node
+    // 通常是在追加，只分出最后一项
+    ext_node &p = path[d], &c = path[d + 1];
+    uint32_t blkno = this->balloc(c.buf->blkno + 1);
+    buf_t *to = blkno ? map_get(blkno, false) : nullptr;
+    if (to == nullptr) {
+        if (blkno)
+            this->bfree(blkno);
+        ext_put(path, depth);
+        return -1;
+    }
+    bool rightmost = true;
+    for (int l = 0; l <= d; l++)
+        rightmost = rightmost && path[l].idx == path[l].hdr->nent - 1;
+    int keep = rightmost ? c.hdr->nent - 1 : c.hdr->nent / 2;
+    extent_blk *tb = (extent_blk *)to->data;
+    memset(to->data, 0, BLKSIZE);
+    tb->hdr = {EXTENT_MAGIC, (uint16_t)(c.hdr->nent - keep), c.hdr->depth};
+    memcpy(tb->ent, &c.ent[keep], tb->hdr.nent * sizeof(extent_t));
+    c.hdr->nent = keep;
+
+    memmove(&p.ent[p.idx + 2], &p.ent[p.idx + 1],
+            (p.hdr->nent - p.idx - 1) * sizeof(extent_t));
+    p.ent[p.idx + 1] = {tb->ent[0].lblk, blkno, 0};
+    p.hdr->nent++;
+    if (d == 0)
+        this->ic->dirty = true;
+    else {
+        Runtime::bcache.put(p.buf, true);
+        p.buf = nullptr;
+    }
+    Runtime::bcache.put(c.buf, true);
+    c.buf = nullptr;
+    Runtime::bcache.put(to, true);
+    ext_put(path, depth);
+    return 0;
+}
+
+/*
+ * 从后往前释放 node 中从逻辑 block keep 开始的部分：
+ * 跨过 keep 的 extent 截短，之后的 extent 整个释放，
+ * 被清空的下层 node 也一并释放。返回 node 是否被修改
+ */
+bool inode_t::ext_trunc(extent_hdr *hdr, extent_t *ents, size_t keep) {
+    bool changed = false;
+    while (hdr->nent > 0) {
+        extent_t &e = ents[hdr->nent - 1];
+        if (hdr->depth == 0) {
+            if (e.lblk + e.len <= keep)
+                break;
+            uint32_t from = e.lblk < keep ? keep - e.lblk : 0;
+            for (uint32_t j = from; j < e.len; j++)
+                this->bfree(e.pblk + j);
+            changed = true;
+            if (from > 0) {
+                e.len = from;
+                break;
+            }
+            hdr->nent--;
+            continue;
+        }
+
+        // 只有最后一个没被清空的 node 跨过 keep，更前面的都不用看
+        buf_t *b = map_get(e.pblk);
+        if (b == nullptr)
+            break;
+        extent_blk *eb = (extent_blk *)b->data;
+        bool dirty = this->ext_trunc(&eb->hdr, eb->ent, keep);
+        if (eb->hdr.nent > 0) {
+            Runtime::bcache.put(b, dirty);
+            break;
+        }
+        Runtime::bcache.put(b);
+        this->bfree(e.pblk);
+        hdr->nent--;
+        changed = true;
+    }
+    return changed;
+}
+
+/* a freed directory has no entries left */
+/* the last link is gone and nobody has it open: free it */
+void inode_t::destory() {
+    if (S_ISDIR(this->ic->inode.mode))
+        Runtime::dcache.purge(this->ino);
+    this->shrinkto(0);
+    this->ic->inode = {};
+    this->ic->dirty = true;
+    Runtime::bitmap.free_ino(this->ino);
+}
+
+/*
+ * 一次遍历映射 [n, n + k)：
+ * indirect block 在 buffer cache 中 pin 住，每一块只取一次；
+ * extent 映射的 inode 每个 extent 只查找一次
+ */
+int inode_t::blk_map(size_t n, size_t k, uint32_t *blknos, bool alloc,
+                     uint8_t *fresh) {
+    if (k == 0)
+        return 0;
+    if (n + k - 1 > (this->getsize() - 1) / BLKSIZE)
+        return -1;
+
+    if (this->ic->inode.isextents()) {
+        for (size_t i = 0; i < k;) {
+            size_t len;
+            uint32_t blkno = this->ext_lookup(n + i, len);
+            if (blkno == 0 && alloc) {
+                blknos[i] = this->ext_walk(n + i, true);
+                if (blknos[i] == 0)
+                    return -1;
+                if (fresh)
+                    fresh[i] = 1;
+                else
+                    zero_blk(blknos[i]);
+                i++;
+                continue;
+            }
+            for (size_t j = 0; j < len && i < k; j++, i++)
+                blknos[i] = blkno ? blkno + j : 0;
+        }
+        return 0;
+    }
+
+    if (n + k > MAX_FILE_BLKS)
+        return -1;
+    buf_t *indirect = nullptr;
+    bool indirty = false;
+    /* which indirect block `indirect` is, counted past the direct links */
+    size_t loaded = SIZE_MAX;
+    int res = 0;
+    for (size_t i = 0; i < k; i++) {
+        size_t m = n + i;
+        uint32_t *blkno;
+        uint32_t goal = (i > 0 && blknos[i - 1]) ? blknos[i - 1] + 1 : 0;
+        if (m < DIRECT_BLKS_PER_INODE)
+            blkno = &this->ic->inode.direct[m];
+        else {
+            size_t idx_for_indirect_blk =
+                (m - DIRECT_BLKS_PER_INODE) / INDRECT_LINK_PER_BLK;
+            size_t idx_in_indirect_blk =
+                (m - DIRECT_BLKS_PER_INODE) % INDRECT_LINK_PER_BLK;
+
+            if (loaded != idx_for_indirect_blk) {
+                if (indirect)
+                    Runtime::bcache.put(indirect, indirty);
+                indirty = false;
+                bool err = false;
+                indirect = this->map_leaf(m, alloc, goal, err);
+                if (err) {
+                    res = -1;
+                    break;
+                }
+                loaded = idx_for_indirect_blk;
+            }
+            // 空洞中的 indirect block 不存在，其中的 block 都是空洞
+            if (indirect == nullptr) {
+                blknos[i] = 0;
+                continue;
+            }
+            blkno = (uint32_t *)indirect->data + idx_in_indirect_blk;
+            if (goal == 0)
+                goal = indirect->blkno + 1;
+        }
+        if (goal == 0 && m > 0 && m < DIRECT_BLKS_PER_INODE && blkno[-1])
+            goal = blkno[-1] + 1;
+
+        if (alloc && *blkno == 0) {
+            *blkno = this->balloc(goal);
+            if (*blkno == 0) {
+                res = -1;
+                break;
+            }
+            if (m < DIRECT_BLKS_PER_INODE)
+                this->ic->dirty = true;
+            else
+                indirty = true;
+            // initialize an empty data block, unless the caller does
+            if (fresh)
+                fresh[i] = 1;
+            else
+                zero_blk(*blkno);
+        }
+        blknos[i] = *blkno;
+    }
+    if (indirect)
+        Runtime::bcache.put(indirect, indirty);
+    return res;
+}
+
+int inode_t::get_blk(size_t n, blkbuf_t *blkbuf, bool alloc) {
+    return this->get_blks(n, 1, blkbuf, alloc);
+}
+
+int inode_t::get_blks(size_t n, size_t k, blkbuf_t *bufs, bool alloc) {
+    std::vector<uint32_t> blknos(k);
+    if (this->blk_map(n, k, blknos.data(), alloc) != 0)
         return -1;
-    blkbuf->blkno = blkno;
-    return blkbuf->fill();
+#ifdef AQFS_STATS
+    /* dir_t reaches all its blocks through here */
+    if (S_ISDIR(this->getmode()))
+        for (size_t i = 0; i < k; i++)
+            if (blknos[i] != 0)
+                iostat.tag(blknos[i], BLK_DIR);
+#endif
+    std::vector<blkio_t> ios;
+    for (size_t i = 0; i < k; i++) {
+        bufs[i].blkno = blknos[i];
+        if (blknos[i] == 0)
+            memset(bufs[i].data, 0, BLKSIZE);
+        else
+            ios.push_back({blknos[i], bufs[i].data});
+    }
+    return Runtime::bcache.readv(ios.data(), ios.size());
 }
 
-int inode_t::read(size_t nbyte, size_t offset, char *buf) {
-    if (offset >= this->inode.size)
+/*
+ * 读写范围内的所有 block 作为一个 batch 一次提交：
+ * 完整的 block 直接和 buf 交换数据，首尾不完整的 block 经过 blkbuf
+ */
+int inode_t::read(size_t nbyte, size_t offset, char *buf, fstate_t *fs) {
+    if (offset >= this->getsize())
         return 0;
-    nbyte = MIN(nbyte, this->inode.size - offset);
-    blkbuf_t blkbuf;
-    for (size_t pos = offset; pos < offset + nbyte;) {
-        if (this->get_blk(pos / BLKSIZE, &blkbuf) != 0)
+    nbyte = MIN(nbyte, this->getsize() - offset);
+    if (nbyte == 0)
+        return 0;
+    if (fs == nullptr)
+        fs = &this->ic->fstate;
+
+    /* 预读时映射过的 block 不必再查一遍 */
+    size_t first = offset / BLKSIZE, last = (offset + nbyte - 1) / BLKSIZE;
+    std::vector<uint32_t> blknos(last - first + 1);
+    std::unique_lock<std::mutex> l(fs->lock);
+    if (fs->mapgen == this->ic->mapgen && first >= fs->mapfirst &&
+        last < fs->mapfirst + fs->map.size()) {
+        auto from = fs->map.begin() + (first - fs->mapfirst);
+        std::copy(from, from + blknos.size(), blknos.begin());
+        l.unlock();
+    } else {
+        l.unlock();
+        if (this->blk_map(first, blknos.size(), blknos.data()) != 0)
             return -1;
-        int bn = MIN(BLKSIZE - pos % BLKSIZE, offset + nbyte - pos);
-        memcpy(buf, &blkbuf.data + pos % BLKSIZE, bn);
-        pos += bn;
-        buf += bn;
     }
+    std::vector<blkio_t> ios;
+    blkbuf_t head, tail;
+    for (size_t n = first; n <= last; n++) {
+        uint32_t blkno = blknos[n - first];
+        size_t pos = MAX(offset, n * BLKSIZE);
+        size_t end = MIN(offset + nbyte, (n + 1) * BLKSIZE);
+        char *dst = buf + (pos - offset);
+        if (end - pos < BLKSIZE)
+            dst = (n == first) ? head.data : tail.data;
+        /* 空洞直接读出 0，不分配 block */
+        if (blkno == 0)
+            memset(dst, 0, BLKSIZE);
+        else
+            ios.push_back({blkno, dst});
+    }
+    if (Runtime::bcache.readv(ios.data(), ios.size()) != 0)
+        return -1;
+    this->readahead(first, last, fs);
+
+    /* 拷贝不完整的首尾 block */
+    size_t headlen = MIN(BLKSIZE - offset % BLKSIZE, nbyte);
+    if (headlen < BLKSIZE)
+        memcpy(buf, head.data + offset % BLKSIZE, headlen);
+    size_t taillen = (offset + nbyte) - last * BLKSIZE;
+    if (last != first && taillen < BLKSIZE)
+        memcpy(buf + (nbyte - taillen), tail.data, taillen);
     return nbyte;
 }
 
+void inode_t::readahead(size_t first, size_t last, fstate_t *fs) {
+    std::unique_lock<std::mutex> l(fs->lock);
+    bool seq = first == fs->ra_next;
+    fs->ra_next = last + 1;
+    if (!seq) {
+        fs->ra_size = 0;
+        fs->ra_end = last + 1;
+        return;
+    }
+    /* 上一个窗口还剩一半以上没有读到时不必预读 */
+    if (fs->ra_end > last + 1 + fs->ra_size / 2)
+        return;
+
+    fs->ra_size = fs->ra_size ? MIN(fs->ra_size * 2, RA_MAX_BLKS) : RA_MIN_BLKS;
+    size_t nblks = (this->getsize() + BLKSIZE - 1) / BLKSIZE;
+    size_t start = MAX(fs->ra_end, last + 1);
+    size_t end = MIN(start + fs->ra_size, nblks);
+    size_t hint = MIN(end + fs->ra_size, nblks);
+    if (start >= hint)
+        return;
+    fs->ra_end = end;
+    l.unlock();
+
+    /*
+     * [start, end) 读入 bcache，它通常在上一次预读时已被提示给磁盘；
+     * [end, hint) 只提示磁盘，让内核在后台读取
+     */
+    std::vector<uint32_t> blknos(hint - start);
+    if (this->blk_map(start, blknos.size(), blknos.data()) != 0)
+        return;
+    l.lock();
+    fs->mapgen = this->ic->mapgen;
+    fs->mapfirst = start;
+    fs->map = blknos;
+    l.unlock();
+    std::vector<uint32_t> load, advise;
+    for (size_t n = start; n < hint; n++) {
+        uint32_t blkno = blknos[n - start];
+        if (blkno != 0)
+            (n < end ? load : advise).push_back(blkno);
+    }
+    Runtime::disk.advise(advise.data(), advise.size());
+    Runtime::bcache.prefetch(load.data(), load.size());
+}
+
+uint32_t inode_t::balloc(size_t goal) {
+    this->ic->mapgen++;
+    return Runtime::bitmap.alloc_blk(goal);
+}
+
+void inode_t::bfree(uint32_t blkno) {
+    this->ic->mapgen++;
+#ifdef AQFS_STATS
+    iostat.untag(blkno);
+#endif
+    Runtime::bitmap.free_blk(blkno);
+}
+
 int inode_t::write(size_t nbyte, size_t offset, const char *buf) {
+    if (nbyte == 0)
+        return 0;
     // Extend file if necessary
-    if (offset + nbyte > this->inode.size) {
-        this->inode.size = offset + nbyte;
-        this->dirty = true;
+    if (offset + nbyte > this->getsize()) {
+        this->ic->inode.setsize(offset + nbyte);
+        this->ic->dirty = true;
     }
-    blkbuf_t blkbuf;
-    for (size_t pos = offset; pos < offset + nbyte;) {
-        if (this->get_blk(pos / BLKSIZE, &blkbuf) != 0)
-            return -1;
-        int bn = MIN(BLKSIZE - (pos % BLKSIZE), offset + nbyte - pos);
-        memcpy(blkbuf.data + (pos % BLKSIZE), buf, bn);
-        blkbuf.persist();
-        pos += bn;
-        buf += bn;
+
+    /*
+     * 新分配的 block 不预先清零：完整的 block 直接被覆盖，
+     * 不完整的首尾 block 在内存中清零后再写入
+     */
+    size_t first = offset / BLKSIZE, last = (offset + nbyte - 1) / BLKSIZE;
+    std::vector<uint32_t> blknos(last - first + 1);
+    std::vector<uint8_t> fresh(last - first + 1);
+    Runtime::bcache.begin_batch();
+    if (this->blk_map(first, blknos.size(), blknos.data(), true,
+                      fresh.data()) != 0) {
+        for (size_t i = 0; i < blknos.size(); i++)
+            if (fresh[i])
+                zero_blk(blknos[i]);
+        Runtime::bcache.end_batch();
+        return -1;
     }
-    return nbyte;
+    std::vector<blkio_t> ios(last - first + 1);
+    std::vector<blkio_t> partial;
+    blkbuf_t head, tail;
+    for (size_t n = first; n <= last; n++) {
+        uint32_t blkno = blknos[n - first];
+        size_t pos = MAX(offset, n * BLKSIZE);
+        size_t end = MIN(offset + nbyte, (n + 1) * BLKSIZE);
+        char *src = (char *)buf + (pos - offset);
+        if (end - pos < BLKSIZE) {
+            blkbuf_t *b = (n == first) ? &head : &tail;
+            b->blkno = blkno;
+            if (fresh[n - first])
+                memset(b->data, 0, BLKSIZE);
+            else
+                partial.push_back({blkno, b->data});
+            src = b->data;
+        }
+        ios[n - first] = {blkno, src};
+    }
+
+    /* 已有的不完整首尾 block 需要先读出来再修改 */
+    int res = 0;
+    if (!partial.empty())
+        res = Runtime::bcache.readv(partial.data(), partial.size());
+    size_t headlen = MIN(BLKSIZE - offset % BLKSIZE, nbyte);
+    if (headlen < BLKSIZE)
+        memcpy(head.data + offset % BLKSIZE, buf, headlen);
+    size_t taillen = (offset + nbyte) - last * BLKSIZE;
+    if (last != first && taillen < BLKSIZE)
+        memcpy(tail.data, buf + (nbyte - taillen), taillen);
+
+    /* 新 block 的链接和数据作为一个整体进入下一次 checkpoint */
+    if (res == 0)
+        res = Runtime::bcache.writev(ios.data(), ios.size(), true);
+    Runtime::bcache.end_batch();
+    return res == 0 ? (int)nbyte : -1;
 }
 
 int inode_t::extendto(size_t nbyte) {
-    if (nbyte > this->inode.size) {
-        this->dirty = 1;
-        this->inode.size = nbyte;
+    if (nbyte > this->getsize()) {
+        this->ic->dirty = 1;
+        this->ic->inode.setsize(nbyte);
     }
     return 0;
 }
@@ -167,20 +846,52 @@ int inode_t::extendto(size_t nbyte) {
  * 当 nbyte >= 当前 inode 大小时，什么都不做
  */
 int inode_t::shrinkto(size_t nbyte) {
-    if (nbyte >= this->inode.size)
+    if (nbyte >= this->getsize())
         return 0;
-    int old_nblocks = (this->inode.size + BLKSIZE - 1) / BLKSIZE;
-    int new_nblocks = (nbyte + BLKSIZE - 1) / BLKSIZE;
-    for (int bno = new_nblocks; bno < old_nblocks; bno++)
-        this->blk_walk(bno, false, true);
-
-    if (new_nblocks <= DIRECT_BLKS_PER_INODE) {
-        memset(this->inode.single_indrect, 0,
-               sizeof(uint32_t) * SINGLE_INDRECT_BLKS_PER_INODE);
-        this->dirty = true;
-    }
-    this->inode.size = nbyte;
-    this->dirty = true;
+    size_t new_nblocks = (nbyte + BLKSIZE - 1) / BLKSIZE;
+    if (this->ic->inode.isextents()) {
+        extent_root *root = this->ic->inode.extents();
+        this->ext_trunc(&root->hdr, root->ent, new_nblocks);
+        if (root->hdr.nent == 0)
+            root->hdr.depth = 0;
+    } else
+        for (size_t bno = new_nblocks; bno < DIRECT_BLKS_PER_INODE; bno++) {
+            uint32_t &direct = this->ic->inode.direct[bno];
+            if (direct == 0)
+                continue;
+            this->bfree(direct);
+            direct = 0;
+            this->ic->dirty = true;
+        }
+
+    /* 保留的最后一个 block 中 nbyte 之后的部分清零，再次扩展时读出 0 */
+    uint32_t blkno;
+    if (nbyte % BLKSIZE != 0 &&
+        this->blk_map(nbyte / BLKSIZE, 1, &blkno) == 0 && blkno != 0) {
+        buf_t *b = Runtime::bcache.get(blkno);
+        if (b != nullptr) {
+            memset(b->data + nbyte % BLKSIZE, 0, BLKSIZE - nbyte % BLKSIZE);
+            Runtime::bcache.put(b, true, true);
+        }
+    }
+
+    /*
+     * indirect blocks left without links are freed too, freeing the blocks
+     * they link on the way
+     */
+    if (!this->ic->inode.isextents()) {
+        struct inode &in = this->ic->inode;
+        size_t first = DIRECT_BLKS_PER_INODE;
+        for (int i = 0; i < SINGLE_INDRECT_BLKS_PER_INODE; i++) {
+            this->map_trunc(in.single_indrect[i], 1, first, new_nblocks);
+            first += INDRECT_LINK_PER_BLK;
+        }
+        this->map_trunc(in.double_indrect, 2, first, new_nblocks);
+        first += INDRECT_LINK_PER_BLK * INDRECT_LINK_PER_BLK;
+        this->map_trunc(in.triple_indrect, 3, first, new_nblocks);
+    }
+    this->ic->inode.setsize(nbyte);
+    this->ic->dirty = true;
     return 0;
 }
 
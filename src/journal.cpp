@@ -0,0 +1,225 @@
+#include "journal.h"
+#include "runtime.h"
+#include <cstring>
+#include <vector>
+
+namespace aqfs {
+
+thread_local int txn_t::depth = 0;
+
+txn_t::txn_t() {
+    Runtime::bcache.begin_batch();
+    if (this->depth++ == 0)
+        Runtime::journal.begin();
+}
+
+txn_t::~txn_t() {
+    if (--this->depth == 0)
+        Runtime::journal.end();
+    Runtime::bcache.end_batch();
+}
+
+/* FNV-1a, a word at a time, over the header and the block copies */
+static uint64_t checksum(const std::vector<char> &blks) {
+    const uint64_t *w = (const uint64_t *)blks.data();
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < blks.size() / sizeof(uint64_t); i++) {
+        h ^= w[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+int journal_t::recover() {
+    this->start = Runtime::super.jstart;
+    this->len = Runtime::super.jlen;
+    this->seq = Runtime::super.jseq;
+    this->head = 0;
+    if (!this->active())
+        return 0;
+
+    /* transactions follow each other from the start of the log */
+    int n = 0;
+    std::vector<char> blks;
+    for (;;) {
+        blks.assign(BLKSIZE, 0);
+        struct jheader *h = (struct jheader *)blks.data();
+        if (Runtime::disk.read(this->start + this->head, blks.data()) != 0)
+            return -1;
+        if (h->magic != JOURNAL_HDR_MAGIC || h->seq != this->seq + 1 ||
+            h->nblks > JOURNAL_HDR_LINKS ||
+            this->head + h->nblks + 2 > this->len)
+            break;
+
+        uint32_t nblks = h->nblks;
+        blks.resize((nblks + 2) * BLKSIZE);
+        h = (struct jheader *)blks.data();
+        std::vector<blkio_t> ios(nblks + 1);
+        for (uint32_t i = 0; i <= nblks; i++)
+            ios[i] = {this->start + this->head + 1 + i,
+                      blks.data() + (1 + i) * BLKSIZE};
+        if (Runtime::disk.readv(ios.data(), ios.size()) != 0)
+            return -1;
+        struct jcommit c = *(struct jcommit *)ios[nblks].buf;
+        blks.resize((nblks + 1) * BLKSIZE);
+        if (c.magic != JOURNAL_COMMIT_MAGIC || c.seq != h->seq ||
+            c.nblks != nblks || c.sum != checksum(blks))
+            break;
+
+        /* write the copies in place */
+        for (uint32_t i = 0; i < nblks; i++)
+            ios[i].blkno = h->blknos[i];
+        if (Runtime::disk.writev(ios.data(), nblks) != 0)
+            return -1;
+        this->seq++;
+        this->head += nblks + 2;
+        n++;
+    }
+    if (n == 0)
+        return 0;
+
+    /* the log is done with once the superblock says so */
+    char buf[BLKSIZE];
+    if (Runtime::disk.sync() != 0 ||
+        Runtime::disk.read(BASE_SUPER_BLK, buf) != 0)
+        return -1;
+    ((super_t *)buf)->jseq = this->seq;
+    if (Runtime::disk.write(BASE_SUPER_BLK, buf) != 0 ||
+        Runtime::disk.sync() != 0)
+        return -1;
+    this->head = 0;
+    return n;
+}
+
+void journal_t::init(bool mapped) {
+    if (mapped)
+        this->len = 0;
+    Runtime::bitmap.defer = this->active();
+    if (!this->active())
+        return;
+    this->maxblks = std::min(JOURNAL_HDR_LINKS, this->len / 2 - 2);
+    this->commits = this->logged = 0;
+    Runtime::bcache.commit_at = this->maxblks / 2;
+}
+
+int journal_t::fini() {
+    int res = this->commit();
+    if (res == 0 && this->active())
+        res = this->checkpoint();
+    Runtime::bcache.commit_at = 0;
+    Runtime::bitmap.defer = false;
+    this->len = 0;
+    return res;
+}
+
+void journal_t::begin() {
+    std::unique_lock<std::mutex> l(this->lock);
+    this->cv.wait(l, [this] { return !this->committing; });
+    this->nrunning++;
+}
+
+void journal_t::end() {
+    std::lock_guard<std::mutex> l(this->lock);
+    if (--this->nrunning == 0)
+        this->cv.notify_all();
+}
+
+/* log the copies of `bufs` as transaction seq + 1, with one write */
+int journal_t::write(buf_t **bufs, uint32_t n) {
+    std::vector<char> blks((n + 2) * BLKSIZE, 0);
+    struct jheader *h = (struct jheader *)blks.data();
+    h->magic = JOURNAL_HDR_MAGIC;
+    h->nblks = n;
+    h->seq = this->seq + 1;
+    for (uint32_t i = 0; i < n; i++) {
+        h->blknos[i] = bufs[i]->blkno;
+        memcpy(blks.data() + (1 + i) * BLKSIZE, bufs[i]->data, BLKSIZE);
+    }
+    struct jcommit c = {JOURNAL_COMMIT_MAGIC, n, h->seq, 0};
+    blks.resize((n + 1) * BLKSIZE);
+    c.sum = checksum(blks);
+    blks.resize((n + 2) * BLKSIZE, 0);
+    memcpy(blks.data() + (n + 1) * BLKSIZE, &c, sizeof(c));
+
+    std::vector<blkio_t> ios(n + 2);
+    for (uint32_t i = 0; i < n + 2; i++)
+        ios[i] = {this->start + this->head + i, blks.data() + i * BLKSIZE};
+    if (Runtime::disk.writev(ios.data(), ios.size()) != 0 ||
+        Runtime::disk.sync() != 0)
+        return -1;
+    this->seq++;
+    this->head += n + 2;
+    this->commits++;
+    this->logged += n;
+    return 0;
+}
+
+/* write everything logged in place and empty the log, while committing */
+int journal_t::checkpoint() {
+    if (Runtime::bcache.flush() != 0 || Runtime::disk.sync() != 0)
+        return -1;
+
+    /* past the superblock's jseq, the log is not replayed */
+    Runtime::super.jseq = this->seq;
+    char buf[BLKSIZE] = {0};
+    std::memcpy(buf, &Runtime::super, sizeof(super_t));
+    if (Runtime::disk.write(BASE_SUPER_BLK, buf) != 0 ||
+        Runtime::disk.sync() != 0)
+        return -1;
+    this->head = 0;
+    Runtime::bcache.clear_logged();
+    return 0;
+}
+
+int journal_t::commit() {
+    /* no checkpoint (i.e. a nested commit) halfway */
+    Runtime::bcache.begin_batch();
+    /* no transaction halfway, and no new ones till the commit is done */
+    std::unique_lock<std::mutex> l(this->lock);
+    this->cv.wait(l, [this] { return !this->committing; });
+    this->committing = true;
+    this->cv.wait(l, [this] { return this->nrunning == 0; });
+    l.unlock();
+
+    /* the in-core metadata into its blocks */
+    int res = 0;
+    if (Runtime::icache.flush() != 0 || Runtime::bitmap.persist() != 0 ||
+        Runtime::super.persist() != 0)
+        res = -1;
+
+    std::vector<buf_t *> bufs;
+    if (res == 0 && this->active())
+        Runtime::bcache.pin_meta(bufs);
+    /* file data first, so that no committed link points to stale data */
+    if (res == 0 &&
+        (Runtime::bcache.flush() != 0 || Runtime::disk.sync() != 0))
+        res = -1;
+    if (res == 0 && !bufs.empty()) {
+        if (bufs.size() <= this->maxblks)
+            res = this->write(bufs.data(), bufs.size());
+        else {
+            /*
+             * more than a transaction can hold, only when very many
+             * operations ran at once: written in place, unprotected
+             */
+            Runtime::bcache.unpin_meta(bufs, true);
+            bufs.clear();
+            res = this->checkpoint();
+        }
+    }
+    Runtime::bcache.unpin_meta(bufs, res == 0);
+    /* blocks freed by what was committed can be reused now */
+    if (res == 0)
+        Runtime::bitmap.release();
+    if (res == 0 && this->active() && this->head > this->len / 2)
+        res = this->checkpoint();
+
+    l.lock();
+    this->committing = false;
+    this->cv.notify_all();
+    l.unlock();
+    Runtime::bcache.end_batch();
+    return res;
+}
+
+} // namespace aqfs
@@ -3,15 +3,23 @@
 #include "fs.h"
 #include "paras.h"
 #include "runtime.h"
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
 #include <limits.h>
 #include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* the volume aqfs.mkfs makes by default, and its inodes */
+const uint64_t MKFS_SIZE = (uint64_t)aqfs::NBLKS * aqfs::BLKSIZE;
+const uint64_t MKFS_INODE_RATIO = 4096; /* bytes of volume per inode */
 
 void print_paras() {
     using namespace aqfs;
-    std::cout << "Block size: " << BLKSIZE << std::endl;
-    std::cout << "Total blocks: " << NBLKS << std::endl;
+    super_t &sb = Runtime::super;
+    std::cout << "Block size: " << sb.blksize << std::endl;
+    std::cout << "Total blocks: " << sb.nblks << std::endl;
     std::cout << std::endl;
     std::cout << "Inode link information:" << std::endl;
     std::cout << "    size of struct inode: " << sizeof(struct inode)
@@ -20,8 +28,14 @@ void print_paras() {
               << std::endl;
     std::cout << "    single indirect blk link per inode: "
               << SINGLE_INDRECT_BLKS_PER_INODE << std::endl;
+    std::cout << "    double / triple indirect blk link per inode: 1 / 1"
+              << std::endl;
     std::cout << "    indirect link per indirect blk: " << INDRECT_LINK_PER_BLK
               << std::endl;
+    std::cout << "    max file size: " << MAX_FILE_SIZE << std::endl;
+    std::cout << "    extents per inode (or per extent blk): "
+              << EXTENTS_IN_INODE << " (" << EXTENTS_PER_BLK << ")"
+              << std::endl;
     std::cout << std::endl;
     std::cout << "Size of directory entry: " << sizeof(direntry) << std::endl;
     std::cout << "Max filename length: " << MAX_FILENAME << std::endl;
@@ -29,65 +43,236 @@ void print_paras() {
     std::cout << "Block information:" << std::endl;
     std::cout << "    boot on block " << BASE_BOOT_BLK << std::endl;
     std::cout << "    super on block " << BASE_SUPER_BLK << std::endl;
-    std::cout << "    bitmap on block " << BASE_BITMAP_BLK << std::endl;
-    std::cout << "    inode block start on block " << BASE_INODE_BLK
+    std::cout << "    inode bitmap on blocks " << sb.imap_start << " - "
+              << sb.dmap_start - 1 << std::endl;
+    std::cout << "    data bitmap on blocks " << sb.dmap_start << " - "
+              << sb.inode_start - 1 << std::endl;
+    std::cout << "    inode block start on block " << sb.inode_start
               << std::endl;
-    std::cout << "    data block start on block " << BASE_DATA_BLKS
+    std::cout << "    data block start on block " << sb.data_start
               << std::endl;
+    std::cout << "    journal on blocks " << sb.jstart << " - "
+              << sb.jstart + sb.jlen - 1 << std::endl;
     std::cout << std::endl;
-    std::cout << "Total inodes: " << N_INODES << std::endl;
-    std::cout << "Total data blocks: " << N_DBLKS << std::endl;
+    std::cout << "Total inodes: " << sb.ninodes << std::endl;
+    std::cout << "Total data blocks: " << sb.jstart - sb.data_start
+              << std::endl;
 }
 
-int main(int argc, char *argv[]) {
-    char *blk_root;
-    if (argc < 2) {
-        printf("Usage: %s [block_root]\n", argv[0]);
-        return -1;
-    } else {
-        blk_root = argv[1];
+void usage(const char *prog) {
+    printf("Usage: %s [-t dir|image] [-s size] [-b blksize] [-N inodes] "
+           "[-i ratio] [block_root]\n",
+           prog);
+    printf("    -t dir      one file per block under directory block_root "
+           "(default)\n");
+    printf("    -t image    a single image file (or raw block device)\n");
+    printf("    -s size     volume size in bytes, with an optional K, M, G "
+           "or T suffix (default 16M)\n");
+    printf("    -b blksize  block size, only %d in this build\n",
+           aqfs::BLKSIZE);
+    printf("    -N inodes   number of inodes\n");
+    printf("    -i ratio    bytes of volume per inode, if -N is not given "
+           "(default %lu)\n",
+           (unsigned long)MKFS_INODE_RATIO);
+}
+
+/* "16M" and the like, 0 if malformed */
+uint64_t parse_size(const char *arg) {
+    char *end;
+    uint64_t n = strtoull(arg, &end, 10);
+    switch (*end) {
+    case 'T': case 't': n <<= 10; /* fall through */
+    case 'G': case 'g': n <<= 10; /* fall through */
+    case 'M': case 'm': n <<= 10; /* fall through */
+    case 'K': case 'k': n <<= 10; end++; break;
     }
+    return *end == '\0' ? n : 0;
+}
 
-    // Create underlying files for virtual block device
+/*
+ * lay out a volume of `size` bytes with `ninodes` inodes in the superblock:
+ * boot and super blocks, the inode bitmap, the data bitmap, the inode
+ * table, data, and the journal at the end; -1 if it does not fit
+ */
+int geometry(uint64_t size, uint64_t ninodes) {
+    using namespace aqfs;
+    super_t &sb = Runtime::super;
+    uint64_t nblks = size / BLKSIZE;
+    ninodes = (ninodes + INODES_PER_BLK - 1) / INODES_PER_BLK * INODES_PER_BLK;
+    if (nblks > UINT32_MAX || ninodes > UINT32_MAX || ninodes < INODES_PER_BLK)
+        return -1;
+    /* a bitmap takes whole blocks, of whole 64-bit words */
+    auto mapblks = [](uint64_t bits) {
+        return ((bits + 63) / 64 * 8 + BLKSIZE - 1) / BLKSIZE;
+    };
+
+    sb.blksize = BLKSIZE;
+    sb.nblks = nblks;
+    sb.ninodes = ninodes;
+    sb.imap_start = BASE_SUPER_BLK + 1;
+    sb.dmap_start = sb.imap_start + mapblks(ninodes);
+    sb.inode_start = sb.dmap_start + mapblks(nblks);
+    uint64_t data_start = sb.inode_start + ninodes / INODES_PER_BLK;
+    sb.jlen = std::min(std::max((uint32_t)(nblks / 256), JOURNAL_BLKS),
+                       JOURNAL_MAX_BLKS);
+    /* at least as much room for data as for the log */
+    if (data_start + 2 * (uint64_t)sb.jlen > nblks)
+        return -1;
+    sb.data_start = data_start;
+    sb.jstart = nblks - sb.jlen;
+    sb.jseq = 0;
+    sb.izeroed = 0; /* none yet, see create_image() */
+    return 0;
+}
+
+/*
+ * one file per block, under directory `blk_root`; a block whose file is
+ * missing reads as zeros, so none are made here
+ */
+int create_blkfiles(const char *blk_root) {
     if (mkdir(blk_root, 0777) != 0) {
         perror("mkdir");
         return -1;
     }
-    char fname[PATH_MAX + 1];
-    char buf[aqfs::BLKSIZE];
-    for (int i = 0; i < aqfs::NBLKS; i++) {
-        sprintf(fname, "%s/blk_%04d", blk_root, i);
-        std::ofstream f(fname);
-        f.write(buf, aqfs::BLKSIZE);
+    return 0;
+}
+
+/* zero blocks [from, to) of a device, without writing them if it can */
+int zero_blks(int fd, uint64_t from, uint64_t to) {
+    off_t off = from * aqfs::BLKSIZE, len = (to - from) * aqfs::BLKSIZE;
+    if (len == 0 ||
+        fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, off, len) ==
+            0)
+        return 0;
+    char buf[aqfs::BLKSIZE] = {0};
+    for (uint64_t i = from; i < to; i++) {
+        if (pwrite(fd, buf, aqfs::BLKSIZE, (off_t)i * aqfs::BLKSIZE) !=
+            aqfs::BLKSIZE) {
+            perror("pwrite");
+            return -1;
+        }
     }
+    return 0;
+}
 
-    print_paras();
+/*
+ * a single image file holding all blocks, or an existing block device
+ * an image file is cut to nothing and extended to the volume's size, a
+ * sparse file of zeros; a device keeps what it holds, except for the blocks
+ * before the inode table and the log, which mount reads first, and which
+ * are zeroed; the inode table is zeroed as it is used, see super_t::izeroed
+ */
+int create_image(const char *image, const aqfs::super_t &sb) {
+    int fd = open(image, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("open");
+        return -1;
+    }
+    uint64_t size = (uint64_t)sb.nblks * aqfs::BLKSIZE;
+    int res = 0;
+    if (S_ISBLK(st.st_mode)) {
+        if ((uint64_t)lseek(fd, 0, SEEK_END) < size) {
+            printf("%s is smaller than %lu bytes\n", image,
+                   (unsigned long)size);
+            res = -1;
+        } else if (zero_blks(fd, 0, sb.inode_start) != 0 ||
+                   zero_blks(fd, sb.jstart, sb.nblks) != 0)
+            res = -1;
+    } else if (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0) {
+        perror("ftruncate");
+        res = -1;
+    }
+    close(fd);
+    return res;
+}
+
+int main(int argc, char *argv[]) {
+    char *blk_root;
+    bool image = false;
+    uint64_t size = MKFS_SIZE, ninodes = 0, ratio = MKFS_INODE_RATIO;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:s:b:N:i:")) != -1) {
+        if (opt == 't' && strcmp(optarg, "image") == 0)
+            image = true;
+        else if (opt == 't' && strcmp(optarg, "dir") == 0)
+            image = false;
+        else if (opt == 's' && (size = parse_size(optarg)) != 0)
+            continue;
+        else if (opt == 'b' && atoi(optarg) == aqfs::BLKSIZE)
+            continue;
+        else if (opt == 'N' && (ninodes = strtoull(optarg, nullptr, 10)) != 0)
+            continue;
+        else if (opt == 'i' && (ratio = parse_size(optarg)) != 0)
+            continue;
+        else {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return -1;
+    } else {
+        blk_root = argv[optind];
+    }
 
     using namespace aqfs;
 
+    /* the layout is decided first, and written to the superblock below */
+    if (ninodes == 0)
+        ninodes = size / ratio;
+    if (geometry(size, ninodes) != 0) {
+        printf("a volume of %lu bytes cannot hold %lu inodes\n",
+               (unsigned long)size, (unsigned long)ninodes);
+        return -1;
+    }
+    super_t sb = Runtime::super;
+
+    // Create the virtual block device
+    int res = image ? create_image(blk_root, sb)
+                    : create_blkfiles(blk_root);
+    if (res != 0)
+        return -1;
+
     // Init runtime
-    Runtime::init(blk_root);
+    if (Runtime::init(blk_root) != 0) {
+        printf("failed to open %s\n", blk_root);
+        return -1;
+    }
 
-    // init super block
+    // init super block, with the journal at the end of the volume
+    Runtime::super = sb;
     Runtime::super.magic = 0xdeadbeef;
+    print_paras();
 
-    // init bitmap block
-    Runtime::bitmap = bitmap_t();
+    // init bitmap blocks, which read as zeros already: only the pieces
+    // with bits set below are written
+    Runtime::bitmap.init();
+    Runtime::bitmap.imap.recount();
+    Runtime::bitmap.dmap.recount();
 
     // Reserve blocks
-    for (int i = 0; i < aqfs::BASE_DATA_BLKS; i++)
+    for (uint32_t i = 0; i < sb.data_start; i++)
+        Runtime::bitmap.dmap.set(i);
+    for (uint32_t i = sb.jstart; i < sb.nblks; i++)
         Runtime::bitmap.dmap.set(i);
 
     // Reserve inode 0 (null), 1 (root)
     Runtime::bitmap.imap.set(0);
     Runtime::bitmap.imap.set(1);
 
-    /* init root directory */
-    dir_t rootdir(1);
-    rootdir.setmode(S_IFDIR | 0755);
-    rootdir.add(1, ".");
-    rootdir.add(1, "..");
-    rootdir.addref();
+    /*
+     * init root directory, persisted on leaving the scope; its inode block
+     * is the first of the inode table to be zeroed
+     */
+    {
+        dir_t rootdir(1);
+        rootdir.setmode(S_IFDIR | 0755);
+        rootdir.add(1, ".");
+        rootdir.add(1, "..");
+        rootdir.addref();
+    }
 
     Runtime::fini();
 
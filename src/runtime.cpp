@@ -3,23 +3,56 @@
 namespace aqfs::Runtime {
 
 disk_t disk;
+bcache_t bcache;
+icache_t icache;
+dcache_t dcache;
 super_t super;
 bitmap_t bitmap;
+journal_t journal;
 
-int init(std::string disk_root) {
-    disk.setroot(disk_root);
+int init(std::string disk_root, bool mmap, size_t nbufs) {
+    if (disk.open(disk_root, mmap) != 0)
+        return -1;
+    bcache.init(nbufs);
+    icache.init(ICACHE_NINODES);
+    dcache.init(DCACHE_NENTRIES);
     super.load();
-    bitmap.load();
+
+    /* redo what was committed before a crash, behind the cache's back */
+    int replayed = journal.recover();
+    if (replayed < 0)
+        return -1;
+    if (replayed > 0) {
+        bcache.fini();
+        bcache.init(nbufs);
+        super.load();
+    }
+    journal.init(disk.blkaddr(BASE_SUPER_BLK) != nullptr);
+
+    /* the layout comes from the superblock, the block size is built in */
+    if (super.blksize != BLKSIZE || bitmap.load() != 0)
+        return -1;
     super.clean = 0;
-    super.persist();
-    return 0;
+    return sync();
+}
+
+int sync() {
+    /* no checkpoint (i.e. a nested sync) halfway */
+    bcache.begin_batch();
+    int res = journal.commit();
+    bcache.end_batch();
+    return res;
 }
 
 int fini() {
     super.clean = 1;
-    bitmap.persist();
-    super.persist();
-    return 0;
+    dcache.fini();
+    /* everything is written in place, the log left empty */
+    int res = journal.fini();
+    icache.fini();
+    bcache.fini();
+    disk.close();
+    return res;
 }
 
 } // namespace aqfs::Runtime
@@ -0,0 +1,267 @@
+#include "stats.h"
+#include "runtime.h"
+#include <algorithm>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace aqfs {
+
+stats_t stats;
+iostat_t iostat;
+thread_local stat_op stat_cur = STAT_NOPS;
+thread_local int io_timer_t::depth = 0;
+
+/* trace records kept in memory before they are written out */
+const size_t TRACE_BUF_RECS = 8192;
+
+static const char *const op_names[STAT_NOPS + 1] = {
+    "getattr", "readlink", "opendir",  "readdir", "mkdir",      "unlink",
+    "rmdir",   "symlink",  "rename",   "link",    "chmod",      "truncate",
+    "open",    "create",   "read",     "write",   "fsync",      "release",
+    "releasedir", "utimens", "(none)"};
+
+static const char *const class_names[BLK_NCLASSES] = {
+    "super", "bitmap", "inode", "dir", "indirect", "data", "journal"};
+
+static const char *const io_names[IO_NOPS] = {"dev_read", "dev_write",
+                                              "dev_sync"};
+
+const char *stat_name(stat_op op) {
+    return op <= STAT_NOPS ? op_names[op] : "?";
+}
+
+const char *blk_class_name(blk_class c) {
+    return c < BLK_NCLASSES ? class_names[c] : "?";
+}
+
+void stat_hist_t::add(uint64_t ns, bool error) {
+    int b = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    if (b >= STAT_BUCKETS)
+        b = STAT_BUCKETS - 1;
+    this->calls.fetch_add(1, std::memory_order_relaxed);
+    if (error)
+        this->errors.fetch_add(1, std::memory_order_relaxed);
+    this->total_ns.fetch_add(ns, std::memory_order_relaxed);
+    this->buckets[b].fetch_add(1, std::memory_order_relaxed);
+    uint64_t max = this->max_ns.load(std::memory_order_relaxed);
+    while (ns > max && !this->max_ns.compare_exchange_weak(
+                           max, ns, std::memory_order_relaxed))
+        ;
+}
+
+/* the upper bound of bucket `b`, in microseconds */
+static double bucket_us(int b) {
+    return b == 0 ? 0 : (double)(1ull << b) / 1000;
+}
+
+/* a copy of a stat_hist_t, taken one field at a time */
+struct hist_snap_t {
+    uint64_t calls, errors, total_ns, max_ns, buckets[STAT_BUCKETS];
+
+    hist_snap_t(const stat_hist_t &h) {
+        this->calls = h.calls.load(std::memory_order_relaxed);
+        this->errors = h.errors.load(std::memory_order_relaxed);
+        this->total_ns = h.total_ns.load(std::memory_order_relaxed);
+        this->max_ns = h.max_ns.load(std::memory_order_relaxed);
+        for (int b = 0; b < STAT_BUCKETS; b++)
+            this->buckets[b] = h.buckets[b].load(std::memory_order_relaxed);
+    }
+
+    /* the percentiles are bucket upper bounds, so within a factor of 2 */
+    double percentile(double p) const {
+        uint64_t n = 0, total = 0;
+        for (int b = 0; b < STAT_BUCKETS; b++)
+            total += this->buckets[b];
+        for (int b = 0; b < STAT_BUCKETS; b++) {
+            n += this->buckets[b];
+            if (n > 0 && n >= p * total)
+                return std::min(bucket_us(b), (double)this->max_ns / 1000);
+        }
+        return (double)this->max_ns / 1000;
+    }
+};
+
+static void table_head(std::string &out) {
+    char line[256];
+    snprintf(line, sizeof(line), "%-12s %10s %8s %10s %10s %10s %10s %12s\n",
+             "op", "calls", "errors", "mean_us", "p50_us", "p90_us", "p99_us",
+             "max_us");
+    out += line;
+}
+
+static void table_row(std::string &out, const char *name,
+                      const hist_snap_t &s) {
+    char line[256];
+    snprintf(line, sizeof(line),
+             "%-12s %10llu %8llu %10.2f %10.2f %10.2f %10.2f %12.2f\n", name,
+             (unsigned long long)s.calls, (unsigned long long)s.errors,
+             (double)s.total_ns / s.calls / 1000, s.percentile(0.5),
+             s.percentile(0.9), s.percentile(0.99), (double)s.max_ns / 1000);
+    out += line;
+}
+
+/* calls per bucket, each named by its upper bound in microseconds */
+static void hist_row(std::string &out, const char *name,
+                     const hist_snap_t &s) {
+    char line[64];
+    snprintf(line, sizeof(line), "%-12s", name);
+    out += line;
+    for (int b = 0; b < STAT_BUCKETS; b++) {
+        if (s.buckets[b] == 0)
+            continue;
+        snprintf(line, sizeof(line), " %g:%llu", bucket_us(b),
+                 (unsigned long long)s.buckets[b]);
+        out += line;
+    }
+    out += "\n";
+}
+
+std::string stats_t::dump() const {
+    std::vector<hist_snap_t> ops(this->ops, this->ops + STAT_NOPS);
+    std::vector<hist_snap_t> io(iostat.calls, iostat.calls + IO_NOPS);
+
+    std::string out;
+    table_head(out);
+    for (int i = 0; i < STAT_NOPS; i++)
+        if (ops[i].calls)
+            table_row(out, op_names[i], ops[i]);
+    for (int i = 0; i < IO_NOPS; i++)
+        if (io[i].calls)
+            table_row(out, io_names[i], io[i]);
+
+    out += "\nhistograms (upper_us:calls)\n";
+    for (int i = 0; i < STAT_NOPS; i++)
+        if (ops[i].calls)
+            hist_row(out, op_names[i], ops[i]);
+    for (int i = 0; i < IO_NOPS; i++)
+        if (io[i].calls)
+            hist_row(out, io_names[i], io[i]);
+
+    /* blocks moved by the device calls above */
+    char line[256];
+    snprintf(line, sizeof(line), "\n%-12s", "blocks");
+    out += line;
+    for (int c = 0; c < BLK_NCLASSES; c++) {
+        snprintf(line, sizeof(line), " %10s", class_names[c]);
+        out += line;
+    }
+    out += "\n";
+    for (int i = IO_READ; i <= IO_WRITE; i++) {
+        snprintf(line, sizeof(line), "%-12s", io_names[i]);
+        out += line;
+        for (int c = 0; c < BLK_NCLASSES; c++) {
+            snprintf(line, sizeof(line), " %10llu",
+                     (unsigned long long)iostat.blks[i][c].load(
+                         std::memory_order_relaxed));
+            out += line;
+        }
+        out += "\n";
+    }
+    return out;
+}
+
+void iostat_t::tag(uint32_t blkno, blk_class c) {
+    std::lock_guard<std::mutex> l(this->taglock);
+    this->tags[blkno] = c;
+}
+
+void iostat_t::untag(uint32_t blkno) {
+    std::lock_guard<std::mutex> l(this->taglock);
+    this->tags.erase(blkno);
+}
+
+blk_class iostat_t::classify(uint32_t blkno) {
+    super_t &sb = Runtime::super;
+    if (blkno <= BASE_SUPER_BLK)
+        return BLK_SUPER;
+    /* before the superblock is loaded, only it is read */
+    if (sb.nblks == 0)
+        return BLK_DATA;
+    if (sb.jlen && blkno >= sb.jstart && blkno < sb.jstart + sb.jlen)
+        return BLK_JOURNAL;
+    if (blkno < sb.inode_start)
+        return BLK_BITMAP;
+    if (blkno < sb.data_start)
+        return BLK_INODE;
+    std::lock_guard<std::mutex> l(this->taglock);
+    auto it = this->tags.find(blkno);
+    return it == this->tags.end() ? BLK_DATA : (blk_class)it->second;
+}
+
+void iostat_t::record(io_op op, const blkio_t *ios, size_t n, uint64_t start,
+                      uint64_t ns) {
+    /* an empty batch is no I/O */
+    if (n == 0 && op != IO_SYNC)
+        return;
+    this->calls[op].add(ns, false);
+    if (n == 0)
+        return;
+    bool tracing = this->tracing.load(std::memory_order_relaxed);
+    std::vector<trace_rec> recs;
+    for (size_t i = 0; i < n; i++) {
+        blk_class c = this->classify(ios[i].blkno);
+        this->blks[op][c].fetch_add(1, std::memory_order_relaxed);
+        if (tracing)
+            recs.push_back({start, ios[i].blkno, (uint8_t)op, (uint8_t)c,
+                            (uint8_t)stat_cur, 0});
+    }
+    if (recs.empty())
+        return;
+    std::lock_guard<std::mutex> l(this->tracelock);
+    this->trace.insert(this->trace.end(), recs.begin(), recs.end());
+    if (this->trace.size() >= TRACE_BUF_RECS)
+        this->trace_flush();
+}
+
+void iostat_t::done(stat_op op, int res) {
+    if (!this->tracing.load(std::memory_order_relaxed))
+        return;
+    std::lock_guard<std::mutex> l(this->tracelock);
+    this->trace.push_back(
+        {stat_now(), (uint32_t)res, TRACE_DONE, 0, (uint8_t)op, 0});
+    if (this->trace.size() >= TRACE_BUF_RECS)
+        this->trace_flush();
+}
+
+/* under tracelock */
+void iostat_t::trace_flush() {
+    const char *p = (const char *)this->trace.data();
+    size_t len = this->trace.size() * sizeof(trace_rec);
+    while (this->tracefd >= 0 && len > 0) {
+        ssize_t n = ::write(this->tracefd, p, len);
+        if (n <= 0) {
+            /* a broken trace is given up on, not the filesystem */
+            perror("aqfs trace");
+            ::close(this->tracefd);
+            this->tracefd = -1;
+            this->tracing = false;
+            break;
+        }
+        p += n;
+        len -= n;
+    }
+    this->trace.clear();
+}
+
+int iostat_t::trace_open(const char *path) {
+    this->trace_close();
+    int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    std::lock_guard<std::mutex> l(this->tracelock);
+    this->tracefd = fd;
+    this->tracing = true;
+    return 0;
+}
+
+void iostat_t::trace_close() {
+    std::lock_guard<std::mutex> l(this->tracelock);
+    this->tracing = false;
+    this->trace_flush();
+    if (this->tracefd >= 0)
+        ::close(this->tracefd);
+    this->tracefd = -1;
+}
+
+} // namespace aqfs
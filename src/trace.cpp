@@ -0,0 +1,108 @@
+#include "paras.h"
+#include "stats.h"
+#include <cstdio>
+#include <vector>
+
+/*
+ * aqfs.trace: sums up a block I/O trace written by `aqfs.fuse -t`
+ * for every operation: its calls, the bytes read or written for it, and
+ * the device blocks read and written while it ran, per call and by block
+ * class; for read and write, also the amplification, device bytes over
+ * the bytes asked for
+ * I/O outside any operation (mount, unmount) is shown as "(none)"
+ */
+
+using namespace aqfs;
+
+struct opsum_t {
+    uint64_t calls = 0;
+    uint64_t bytes = 0; /* done by read and write */
+    uint64_t blks[IO_SYNC][BLK_NCLASSES] = {};
+
+    uint64_t total(int io) const {
+        uint64_t n = 0;
+        for (int c = 0; c < BLK_NCLASSES; c++)
+            n += this->blks[io][c];
+        return n;
+    }
+};
+
+static void usage(const char *prog) {
+    printf("Usage: %s <trace>\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        usage(argv[0]);
+        return -1;
+    }
+    FILE *f = fopen(argv[1], "rb");
+    if (f == nullptr) {
+        perror(argv[1]);
+        return -1;
+    }
+
+    std::vector<opsum_t> ops(STAT_NOPS + 1);
+    std::vector<trace_rec> recs(4096);
+    size_t n, total = 0;
+    while ((n = fread(recs.data(), sizeof(trace_rec), recs.size(), f)) > 0) {
+        total += n;
+        for (size_t i = 0; i < n; i++) {
+            const trace_rec &r = recs[i];
+            if (r.fop > STAT_NOPS ||
+                (r.op != TRACE_DONE &&
+                 (r.op >= IO_SYNC || r.cls >= BLK_NCLASSES))) {
+                fprintf(stderr, "%s: bad record %zu\n", argv[1],
+                        total - n + i);
+                return -1;
+            }
+            opsum_t &o = ops[r.fop];
+            if (r.op != TRACE_DONE)
+                o.blks[r.op][r.cls]++;
+            else {
+                o.calls++;
+                if ((r.fop == STAT_READ || r.fop == STAT_WRITE) &&
+                    (int32_t)r.arg > 0)
+                    o.bytes += r.arg;
+            }
+        }
+    }
+    fclose(f);
+
+    /* blocks per call, the whole of them, then by class */
+    printf("%-12s %10s %12s %10s %10s %8s\n", "op", "calls", "bytes",
+           "rd/call", "wr/call", "amp");
+    for (int i = 0; i <= STAT_NOPS; i++) {
+        const opsum_t &o = ops[i];
+        if (o.calls == 0 && o.total(IO_READ) + o.total(IO_WRITE) == 0)
+            continue;
+        double per = o.calls ? o.calls : 1;
+        printf("%-12s %10llu %12llu %10.2f %10.2f", stat_name((stat_op)i),
+               (unsigned long long)o.calls, (unsigned long long)o.bytes,
+               o.total(IO_READ) / per, o.total(IO_WRITE) / per);
+        if (o.bytes)
+            printf(" %8.2f\n", (double)(o.total(IO_READ) + o.total(IO_WRITE)) *
+                                   BLKSIZE / o.bytes);
+        else
+            printf(" %8s\n", "-");
+    }
+
+    printf("\n%-12s %-6s", "per call", "");
+    for (int c = 0; c < BLK_NCLASSES; c++)
+        printf(" %9s", blk_class_name((blk_class)c));
+    printf("\n");
+    for (int i = 0; i <= STAT_NOPS; i++) {
+        const opsum_t &o = ops[i];
+        double per = o.calls ? o.calls : 1;
+        for (int io = IO_READ; io <= IO_WRITE; io++) {
+            if (o.total(io) == 0)
+                continue;
+            printf("%-12s %-6s", stat_name((stat_op)i),
+                   io == IO_READ ? "read" : "write");
+            for (int c = 0; c < BLK_NCLASSES; c++)
+                printf(" %9.2f", o.blks[io][c] / per);
+            printf("\n");
+        }
+    }
+    return 0;
+}
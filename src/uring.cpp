@@ -0,0 +1,143 @@
+#include "uring.h"
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define AQFS_HAVE_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+namespace aqfs {
+
+#ifdef AQFS_HAVE_URING
+
+int uring_t::init(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0)
+        return -1;
+
+    this->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    this->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    this->sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+
+    void *sq = mmap(nullptr, this->sq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void *cq = mmap(nullptr, this->cq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(nullptr, this->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        if (sq != MAP_FAILED)
+            munmap(sq, this->sq_size);
+        if (cq != MAP_FAILED)
+            munmap(cq, this->cq_size);
+        if (sqes != MAP_FAILED)
+            munmap(sqes, this->sqes_size);
+        close(fd);
+        return -1;
+    }
+
+    char *s = (char *)sq, *c = (char *)cq;
+    this->sq_head = (unsigned *)(s + p.sq_off.head);
+    this->sq_tail = (unsigned *)(s + p.sq_off.tail);
+    this->sq_mask = (unsigned *)(s + p.sq_off.ring_mask);
+    this->sq_array = (unsigned *)(s + p.sq_off.array);
+    this->sqes = (io_uring_sqe *)sqes;
+    this->cq_head = (unsigned *)(c + p.cq_off.head);
+    this->cq_tail = (unsigned *)(c + p.cq_off.tail);
+    this->cq_mask = (unsigned *)(c + p.cq_off.ring_mask);
+    this->cqes = (io_uring_cqe *)(c + p.cq_off.cqes);
+
+    this->sq_ptr = sq;
+    this->cq_ptr = cq;
+    this->entries = p.sq_entries;
+    this->pending = 0;
+    this->fd = fd;
+    return 0;
+}
+
+void uring_t::fini() {
+    if (this->fd < 0)
+        return;
+    munmap(this->sqes, this->sqes_size);
+    munmap(this->cq_ptr, this->cq_size);
+    munmap(this->sq_ptr, this->sq_size);
+    close(this->fd);
+    this->fd = -1;
+}
+
+int uring_t::prep(bool write, int fd, const struct iovec *iov, unsigned n,
+                  off_t off, uint64_t data) {
+    unsigned head = __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *this->sq_tail;
+    if (tail - head >= this->entries ||
+        this->pending + (tail - head) >= this->entries)
+        return -1;
+
+    unsigned idx = tail & *this->sq_mask;
+    io_uring_sqe *sqe = &this->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)iov;
+    sqe->len = n;
+    sqe->off = off;
+    sqe->user_data = data;
+    this->sq_array[idx] = idx;
+    __atomic_store_n(this->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int uring_t::submit_and_wait(uint64_t *data, int *res, unsigned max) {
+    unsigned head = __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tosubmit = *this->sq_tail - head;
+    unsigned towait = this->pending + tosubmit;
+
+    while (tosubmit > 0 || this->pending > 0) {
+        int n = syscall(__NR_io_uring_enter, this->fd, tosubmit,
+                        this->pending + tosubmit, IORING_ENTER_GETEVENTS,
+                        nullptr, 0);
+        if (n < 0 && errno != EINTR)
+            return -1;
+        if (n > 0) {
+            tosubmit -= n;
+            this->pending += n;
+        }
+
+        /* reap everything that has completed */
+        unsigned chead = *this->cq_head;
+        unsigned ctail = __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE);
+        for (; chead != ctail; chead++) {
+            io_uring_cqe *cqe = &this->cqes[chead & *this->cq_mask];
+            unsigned i = towait - (this->pending + tosubmit);
+            if (i < max) {
+                data[i] = cqe->user_data;
+                res[i] = cqe->res;
+            }
+            this->pending--;
+        }
+        __atomic_store_n(this->cq_head, chead, __ATOMIC_RELEASE);
+    }
+    return towait;
+}
+
+#else /* no io_uring on this platform */
+
+int uring_t::init(unsigned entries) { return -1; }
+void uring_t::fini() {}
+int uring_t::prep(bool write, int fd, const struct iovec *iov, unsigned n,
+                  off_t off, uint64_t data) {
+    return -1;
+}
+int uring_t::submit_and_wait(uint64_t *data, int *res, unsigned max) {
+    return -1;
+}
+
+#endif
+
+} // namespace aqfs